@@ -35,6 +35,9 @@ namespace daf
 
 		void OnEvent(const events::ActorUpdateEvent& a_event, events::EventDispatcher<events::ActorUpdateEvent>* a_dispatcher) override {
 			auto actor = a_event.actor;
+			if (m_actor_pending_update_appearance.empty()) {  // Most updates, skips the bucket lock of find()
+				return;
+			}
 
 			_Pending_List_T::accessor acc;
 			if (!actor || !m_actor_pending_update_appearance.find(acc, actor)) {
@@ -6,22 +6,18 @@ void daf::ConditionalChargenMorphManager::OnEvent(const events::ArmorOrApparelEq
 	auto actor = a_event.actor;
 	auto armo = a_event.armorOrApparel;
 
-	{
-		tbb::concurrent_hash_map<RE::TESFormID, time_t>::accessor acc;
-		if (!m_actor_watchlist.find(acc, actor->formID)) {
-			return;
-		}
-		acc->second = a_event.when();
+	auto state = m_actor_watchlist.Find(actor->formID);
+	if (!state) {
+		return;
 	}
+	state->last_update.store(a_event.when(), std::memory_order_relaxed);
+	state->lod.store(MorphLOD::kNear, std::memory_order_relaxed);  // Promoted until its next update measures the distance again
 
 	switch (equip_type) {
 	case events::ArmorOrApparelEquippedEvent::EquipType::kEquip:
-		logger::info("Armor Keyword Morph: {} equipped", utils::make_str(a_event.actor));
-		m_actors_pending_reevaluation.insert(actor);
-		break;
 	case events::ArmorOrApparelEquippedEvent::EquipType::kUnequip:
-		logger::info("Armor Keyword Morph: {} unequipped", utils::make_str(a_event.actor));
-		m_actors_pending_reevaluation.insert(actor);
+		m_equip_changes.Add(actor, a_event.when(), armo);  // Logged once per reevaluation, see ReevaluateGranted()
+		state->equip_pending.store(true, std::memory_order_release);
 		break;
 	}
 }
@@ -59,31 +55,48 @@ void daf::ConditionalChargenMorphManager::OnEvent(const events::ActorUpdateEvent
 	//	}
 	//}
 
-	tbb::concurrent_hash_map<RE::TESFormID, time_t>::accessor acc;
-	if (!actor || !m_actor_watchlist.find(acc, actor->formID)) {
+	if (!actor) {
 		return;
 	}
 
-	// Reevaluate immediately if the actor is pending reevaluation
-	if (m_actors_pending_reevaluation.contains(actor)) {
-		std::lock_guard lock(m_actors_pending_reevaluation_erase_lock);
-		acc->second = a_event.when();
-		if (this->ReevaluateActorMorph(actor)) {
+	auto state = m_actor_watchlist.Find(actor->formID);
+	if (state) {
+		// Results evaluated off the game thread are committed from the actor's own update
+		if (state->evaluation_ready.load(std::memory_order_relaxed) && state->evaluation_ready.exchange(false, std::memory_order_acq_rel)) {
+			CommitEvaluatedMorphs(actor);
 		}
-		logger::info("Actor {} updating morphs", utils::make_str(actor));
-		UpdateActorAppearance(actor, ActorAppearanceUpdator::UpdateType::kBodyMorphOnly);
-		m_actors_pending_reevaluation.unsafe_erase(actor);
-		return;
-	}
 
-	// Update if the actor has not been updated for a certain interval
-	if (a_event.when() - acc->second > ActorUpdateInterval_ms) {
-		acc->second = a_event.when();
-		if (this->ReevaluateActorMorph(actor)) {
-			logger::info("Actor {} updating morphs regular", utils::make_str(actor));
-			UpdateActorAppearance(actor, ActorAppearanceUpdator::UpdateType::kBodyMorphOnly);
+		EquipChangeDebouncer::Change change;
+		bool                         equip_changed = false;
+		if (state->equip_pending.load(std::memory_order_relaxed) && state->equip_pending.exchange(false, std::memory_order_acq_rel)) {
+			equip_changed = m_equip_changes.Take(actor, a_event.when(), EquipDebounceWindow_ms, EquipDebounceMaxDelay_ms, change);
+			if (!equip_changed) {  // Window still open
+				state->equip_pending.store(true, std::memory_order_release);
+			}
 		}
-		return;
+
+		if (equip_changed) {  // Equipment changed, always refresh the appearance regardless of LOD
+			state->last_update.store(a_event.when(), std::memory_order_relaxed);
+			m_scheduler.Request(actor, a_event.when(), true, change.armors);
+		} else {  // Not updated for the interval of its LOD tier
+			auto lod = GetLOD(actor);
+			auto interval = MorphLODUpdateInterval_ms[std::to_underlying(lod)];
+			state->lod.store(lod, std::memory_order_relaxed);
+			if (interval >= 0 && a_event.when() - state->last_update.load(std::memory_order_relaxed) > interval) {
+				state->last_update.store(a_event.when(), std::memory_order_relaxed);
+				m_scheduler.Request(actor, a_event.when());
+			}
+		}
+	}
+
+	// Whichever watched actor starts the frame drives the scheduler
+	if (state && StartsFrame(*state)) {
+		ProcessScheduledReevaluations(a_event.when());
+	}
+
+	// Granted actors snapshot themselves, their data is only read from their own update
+	if (state && state->reevaluation_granted.load(std::memory_order_relaxed) && state->reevaluation_granted.exchange(false, std::memory_order_acq_rel)) {
+		ReevaluateGranted(actor, a_event.when());
 	}
 }
 
@@ -93,12 +106,18 @@ void daf::ConditionalChargenMorphManager::OnEvent(const events::ActorFirstUpdate
 
 	auto actor = a_event.actor;
 	{
-		tbb::concurrent_hash_map<RE::TESFormID, time_t>::accessor acc;
-		if (!actor || !m_actor_watchlist.find(acc, actor->formID)) {
+		auto state = actor ? m_actor_watchlist.Find(actor->formID) : nullptr;
+		if (!state) {
 			return;
 		}
 
-		acc->second = a_event.when();
+		state->last_update.store(a_event.when(), std::memory_order_relaxed);
+
+		// The actor's 3D was (re)loaded, its morphs have to be committed again even if its snapshot didn't change.
+		// A pending job would commit an older snapshot after this one
+		m_actor_sessions.erase(actor->formID);
+		DropEvaluation(actor->formID);
+
 		if (this->ReevaluateActorMorph(actor)) {
 			logger::info("Actor {} updating morphs first", utils::make_str(actor));
 			UpdateActorAppearanceImmediate(actor, ActorAppearanceUpdator::UpdateType::kBodyMorphOnly);
@@ -106,6 +125,28 @@ void daf::ConditionalChargenMorphManager::OnEvent(const events::ActorFirstUpdate
 	}
 }
 
+void daf::ConditionalChargenMorphManager::OnEvent(const events::ActorLoadedEvent& a_event, events::EventDispatcher<events::ActorLoadedEvent>* a_dispatcher)
+{
+	if (!a_event.actor) {
+		return;
+	}
+
+	if constexpr (WatchAllLoadedActors) {
+		if (a_event.loaded) {
+			Watch(a_event.actor);
+		} else {
+			Unwatch(a_event.actor);
+		}
+	} else if (!a_event.loaded) {  // Stays watched, it's reevaluated again on its next first update
+		if (auto state = m_actor_watchlist.Find(a_event.actor->formID); state) {
+			state->equip_pending.store(false, std::memory_order_release);
+			m_equip_changes.Cancel(a_event.actor);
+		}
+		m_scheduler.Cancel(a_event.actor->formID);
+		DropEvaluation(a_event.actor->formID);
+	}
+}
+
 void daf::ConditionalChargenMorphManager::OnEvent(const events::SaveLoadEvent& a_event, events::EventDispatcher<events::SaveLoadEvent>* a_dispatcher)
 {
 	if (a_event.saveLoadType != events::SaveLoadEvent::SaveLoadType::kSaveLoad) {
@@ -113,39 +154,337 @@ void daf::ConditionalChargenMorphManager::OnEvent(const events::SaveLoadEvent& a
 	}
 
 	logger::info("Save loaded.");
+	LogStats();
+
+	// Rulesets are only replaced below, on this thread
+	auto evaluation = daf::MorphRuleSetManager::GetSingleton().GetEvaluationStats();
+	if (auto total = evaluation.rules_evaluated + evaluation.rules_skipped; total > 0) {
+		logger::info("Rule evaluation: {} rules evaluated, {} skipped as unaffected by changed symbols ({:.1f}% skipped).",
+			evaluation.rules_evaluated, evaluation.rules_skipped, 100.0 * evaluation.rules_skipped / total);
+	}
+
+	m_scheduler.Clear();
+	m_equip_changes.Clear();
+	m_actor_sessions.clear();
+	m_evaluation_epoch.fetch_add(1);
 
 	daf::MorphRuleSetManager::GetSingleton().LoadRulesets(utils::GetPluginFolder() + "\\Rulesets");
 
 	return;
 }
 
+daf::MorphLOD daf::ConditionalChargenMorphManager::GetLOD(RE::Actor* a_actor)
+{
+	auto player = RE::PlayerCharacter::GetSingleton();
+	if (a_actor == player) {
+		return MorphLOD::kNear;
+	}
+	if (!utils::IsActor3DLoaded(a_actor)) {
+		return MorphLOD::kFar;
+	}
+
+	float distance = utils::GetDistanceSquared(a_actor, player);
+	if (distance < MorphLODNearDistance * MorphLODNearDistance) {
+		return MorphLOD::kNear;
+	} else if (distance < MorphLODMidDistance * MorphLODMidDistance) {
+		return MorphLOD::kMid;
+	}
+	return MorphLOD::kFar;
+}
+
+bool daf::ConditionalChargenMorphManager::StartsFrame(WatchState& a_state)
+{
+	auto frame = m_frame.load(std::memory_order_acquire);
+	if (a_state.frame.exchange(frame, std::memory_order_relaxed) != frame) {  // First update of the actor in this frame
+		return false;
+	}
+	if (!m_frame.compare_exchange_strong(frame, frame + 1, std::memory_order_acq_rel)) {  // Another actor started it
+		return false;
+	}
+	a_state.frame.store(frame + 1, std::memory_order_relaxed);
+	return true;
+}
+
+void daf::ConditionalChargenMorphManager::ProcessScheduledReevaluations(time_t a_now)
+{
+	// A slow frame may still be processed when the next one starts
+	std::unique_lock lock(m_scheduler_process_lock, std::try_to_lock);
+	if (!lock.owns_lock()) {
+		return;
+	}
+
+	// Last frame's picks have all snapshotted themselves by now
+	DispatchSubmittedJobs();
+
+	if (a_now - m_last_stats_log >= StatsLogInterval_ms) {
+		if (m_last_stats_log != 0) {
+			LogStats();
+		}
+		m_last_stats_log = a_now;
+	}
+
+	m_scheduler.Process(RE::PlayerCharacter::GetSingleton(), a_now, ReevaluationBudget_ms, ReevaluationMaxDeferral_ms, [this](RE::Actor* a_actor) {
+		auto state = m_actor_watchlist.Find(a_actor->formID);
+		if (!state) {  // Unwatched meanwhile
+			return false;
+		}
+		state->reevaluation_granted.store(true, std::memory_order_release);
+		return true;
+	});
+}
+
+void daf::ConditionalChargenMorphManager::LogStats() const
+{
+	auto scheduler = GetSchedulerStats();
+	logger::info("Reevaluation scheduler: {} frames, {} actors granted, {} frames over budget, {} requests dropped. Last frame: {} granted, {} carried over, {:.3f} ms.",
+		scheduler.frames, scheduler.granted, scheduler.overruns, scheduler.dropped, scheduler.last_frame.granted, scheduler.last_frame.carried_over, scheduler.last_frame.elapsed_ms);
+
+	auto [hits, misses] = GetSnapshotCacheStats();
+	if (auto total = hits + misses; total > 0) {
+		logger::info("Snapshot cache: {} reevaluations skipped as unchanged, {} evaluated ({:.1f}% hit rate).", hits, misses, 100.0 * hits / total);
+	}
+
+	auto push = GetPushStats();
+	if (push.pushes > 0) {
+		logger::info("Morph pushes: {} pushes, {} rebinds, {} morphs written, {:.3f} ms average and {:.3f} ms max writing into NPCs.",
+			push.pushes, push.rebinds, push.morphs_written, push.critical_ns / 1e6 / push.pushes, push.max_critical_ns / 1e6);
+	}
+}
+
+void daf::ConditionalChargenMorphManager::ReevaluateGranted(RE::Actor* a_actor, time_t a_now)
+{
+	ReevaluationScheduler::Grant grant;
+	if (!m_scheduler.Take(a_actor->formID, grant)) {  // Cancelled meanwhile
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	if (!grant.changed_armors.empty()) {
+		logger::info("Actor {} equipment changed: {} armors", utils::make_str(a_actor), grant.changed_armors.size());
+	}
+
+	switch (SubmitActorMorphEvaluation(a_actor, grant.forced)) {
+	case Submission::kSubmitted:
+		break;
+	case Submission::kBusy:  // Snapshot it again once its previous job is committed, with the same armors
+		m_scheduler.Request(a_actor, a_now, grant.forced, grant.changed_armors);
+		break;
+	case Submission::kUnchanged:
+		if (grant.forced) {
+			logger::info("Actor {} updating morphs", utils::make_str(a_actor));
+			UpdateActorAppearance(a_actor, ActorAppearanceUpdator::UpdateType::kBodyMorphOnly);
+		}
+		break;
+	case Submission::kSynchronous:
+		if (this->ReevaluateActorMorph(a_actor) || grant.forced) {
+			logger::info("Actor {} updating morphs{}", utils::make_str(a_actor), grant.forced ? "" : " regular");
+			UpdateActorAppearance(a_actor, ActorAppearanceUpdator::UpdateType::kBodyMorphOnly);
+		}
+		break;
+	}
+
+	m_scheduler.Report(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+daf::ConditionalChargenMorphManager::Submission daf::ConditionalChargenMorphManager::SubmitActorMorphEvaluation(RE::Actor* a_actor, bool a_forced)
+{
+	auto ruleSet = daf::MorphRuleSetManager::GetSingleton().GetSharedForActor(a_actor);
+	if (!ruleSet) {
+		return Submission::kUnchanged;
+	} else if (!ruleSet->IsCompiled()) {
+		return Submission::kSynchronous;
+	}
+
+	auto job = std::make_unique<EvaluationJob>();
+	{
+		tbb::concurrent_hash_map<RE::TESFormID, ActorContext>::accessor acc;
+		m_actor_contexts.insert(acc, a_actor->formID);
+		if (acc->second.in_flight) {
+			return Submission::kBusy;
+		}
+		if (!acc->second.context) {
+			acc->second.context = std::make_unique<MorphEvaluationRuleSet::EvaluationContext>();
+		}
+
+		ruleSet->Snapshot(a_actor, *acc->second.context);
+		if (acc->second.context->IsUnchanged()) {  // Same inputs as last time, the morphs are already committed
+			m_snapshot_cache_hits.fetch_add(1, std::memory_order_relaxed);
+			return Submission::kUnchanged;
+		}
+		m_snapshot_cache_misses.fetch_add(1, std::memory_order_relaxed);
+
+		job->serial = m_next_job_serial.fetch_add(1);
+		job->context = std::move(acc->second.context);
+		acc->second.in_flight = job->serial;
+	}
+
+	job->form_id = a_actor->formID;
+	job->ruleset = std::move(ruleSet);
+	job->epoch = m_evaluation_epoch.load();
+	job->forced = a_forced;
+
+	m_submitted_jobs.push(std::move(job));
+	return Submission::kSubmitted;
+}
+
+void daf::ConditionalChargenMorphManager::DispatchSubmittedJobs()
+{
+	std::unordered_map<MorphEvaluationRuleSet*, std::vector<EvaluationJob*>> jobs_per_ruleset;
+	for (std::unique_ptr<EvaluationJob> job; m_submitted_jobs.try_pop(job);) {
+		jobs_per_ruleset[job->ruleset.get()].emplace_back(job.release());
+	}
+
+	// The jobs own everything they touch, the compiled ruleset is only read
+	for (auto& [ruleset, jobs] : jobs_per_ruleset) {
+		m_evaluation_arena.enqueue([this, a_jobs = std::move(jobs)]() {
+			std::vector<std::unique_ptr<EvaluationJob>> jobs;
+			jobs.reserve(a_jobs.size());
+			for (auto job : a_jobs) {
+				jobs.emplace_back(job);
+			}
+			EvaluateJobs(jobs);
+		});
+	}
+}
+
+void daf::ConditionalChargenMorphManager::EvaluateJobs(std::vector<std::unique_ptr<EvaluationJob>>& a_jobs)
+{
+	if (a_jobs.size() == 1) {
+		a_jobs[0]->ruleset->Evaluate(*a_jobs[0]->context, a_jobs[0]->results);
+	} else {
+		std::vector<MorphEvaluationRuleSet::EvaluationContext*> contexts;
+		std::vector<MorphEvaluationRuleSet::ResultTable*>       results;
+		for (auto& job : a_jobs) {
+			contexts.emplace_back(job->context.get());
+			results.emplace_back(&job->results);
+		}
+		a_jobs[0]->ruleset->EvaluateBatch(contexts, results);
+	}
+
+	for (auto& job : a_jobs) {
+		auto form_id = job->form_id;
+		{
+			tbb::concurrent_hash_map<RE::TESFormID, ActorContext>::accessor acc;
+			if (!m_actor_contexts.find(acc, form_id) || acc->second.in_flight != job->serial) {
+				continue;  // Unwatched, unloaded or reloaded meanwhile
+			}
+			acc->second.evaluated = std::move(job);
+		}
+		if (auto state = m_actor_watchlist.Find(form_id); state) {
+			state->evaluation_ready.store(true, std::memory_order_release);
+		}
+	}
+}
+
+void daf::ConditionalChargenMorphManager::CommitEvaluatedMorphs(RE::Actor* a_actor)
+{
+	std::unique_ptr<EvaluationJob> job;
+	{
+		tbb::concurrent_hash_map<RE::TESFormID, ActorContext>::accessor acc;
+		if (!m_actor_contexts.find(acc, a_actor->formID) || !acc->second.evaluated) {
+			return;
+		}
+		job = std::move(acc->second.evaluated);
+		if (acc->second.in_flight != job->serial) {  // Reevaluated synchronously meanwhile
+			return;
+		}
+		acc->second.in_flight = 0;
+		acc->second.context = std::move(job->context);
+
+		// Snapshotted before a save load, or the actor was unloaded since: evaluate it again from a fresh snapshot
+		if (job->epoch != m_evaluation_epoch.load() || utils::GetLoadedActor(job->form_id) != a_actor) {
+			acc->second.context->Invalidate();
+			return;
+		}
+	}
+
+	if (CommitMorphResults(a_actor, job->results) || job->forced) {
+		logger::info("Actor {} updating morphs{}", utils::make_str(a_actor), job->forced ? "" : " regular");
+		UpdateActorAppearance(a_actor, ActorAppearanceUpdator::UpdateType::kBodyMorphOnly);
+	}
+}
+
+void daf::ConditionalChargenMorphManager::DropEvaluation(RE::TESFormID a_formID)
+{
+	tbb::concurrent_hash_map<RE::TESFormID, ActorContext>::accessor acc;
+	if (m_actor_contexts.find(acc, a_formID)) {
+		acc->second.in_flight = 0;  // A running job finds its serial outdated and drops its results
+		acc->second.evaluated.reset();
+		if (acc->second.context) {
+			acc->second.context->Invalidate();
+		}
+	}
+}
+
 bool daf::ConditionalChargenMorphManager::ReevaluateActorMorph(RE::Actor* a_actor)
 {
 	auto& rs_manager = daf::MorphRuleSetManager::GetSingleton();
 
-	auto ruleSet = rs_manager.GetForActor(a_actor);
+	// Held until the results are committed, a save load may replace the ruleset meanwhile
+	auto ruleSet = rs_manager.GetSharedForActor(a_actor);
 	if (!ruleSet) {
 		return false;
 	}
 
-	daf::MorphEvaluationRuleSet::ResultTable results;
+	// Reused by every reevaluation on this thread, so steady-state evaluation doesn't allocate results
+	thread_local daf::MorphEvaluationRuleSet::ResultTable results;
 
-	daf::DynamicMorphSession session(daf::tokens::conditional_chargen_morph_manager, a_actor);
+	if (ruleSet->IsCompiled()) {
+		// The compiled ruleset is only read, so actors sharing it are evaluated concurrently on their own contexts
+		tbb::concurrent_hash_map<RE::TESFormID, ActorContext>::accessor acc;
+		m_actor_contexts.insert(acc, a_actor->formID);
+		if (!acc->second.context) {  // First evaluation, or lent to a job whose results are dropped now
+			acc->second.context = std::make_unique<MorphEvaluationRuleSet::EvaluationContext>();
+			acc->second.in_flight = 0;
+		}
 
-	{
+		auto& context = *acc->second.context;
+		ruleSet->Snapshot(a_actor, context);
+		if (context.IsUnchanged()) {  // Same inputs as last time, the morphs are already committed
+			m_snapshot_cache_hits.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		m_snapshot_cache_misses.fetch_add(1, std::memory_order_relaxed);
+		ruleSet->Evaluate(context, results);
+	} else {
 		std::lock_guard ruleset_lock(ruleSet->m_ruleset_spinlock);
 		ruleSet->Snapshot(a_actor);
 		ruleSet->Evaluate(results);
 	}
 
-	session.RestoreMorph();
-	for (auto& [morph_name, result] : results) {
-		if (result.is_setter) {
-			session.MorphTargetCommit(std::string(morph_name), result.value);
-		} else {
-			session.MorphOffsetCommit(std::string(morph_name), result.value);
+	return CommitMorphResults(a_actor, results);
+}
+
+bool daf::ConditionalChargenMorphManager::CommitMorphResults(RE::Actor* a_actor, const MorphEvaluationRuleSet::ResultTable& a_results)
+{
+	auto commit = [this, &a_results](daf::DynamicMorphSession& a_session) {
+		a_session.RestoreMorph();
+		for (auto& result : a_results) {
+			if (result.is_setter) {
+				a_session.MorphTargetCommit(result.morph_id, result.value);
+			} else {
+				a_session.MorphOffsetCommit(result.morph_id, result.value);
+			}
+		}
+		if (!a_session.PushCommitsIfReaches(DiffThreshold)) {
+			return false;
 		}
+		RecordPush(a_session.GetLastWrite());
+		return true;
+	};
+
+	if (!m_actor_watchlist.Find(a_actor->formID)) {  // Not kept, the actor may never be reevaluated again
+		daf::DynamicMorphSession session(daf::tokens::conditional_chargen_morph_manager, a_actor);
+		return commit(session);
 	}
 
-	return session.PushCommits(DiffThreshold) > DiffThreshold;
+	tbb::concurrent_hash_map<RE::TESFormID, std::unique_ptr<DynamicMorphSession>>::accessor acc;
+	m_actor_sessions.insert(acc, a_actor->formID);
+	if (!acc->second) {
+		acc->second = std::make_unique<DynamicMorphSession>(daf::tokens::conditional_chargen_morph_manager, a_actor);
+	} else if (!acc->second->IsCurrent(a_actor)) {  // Morphs written by someone else, or a new NPC record
+		acc->second->Snapshot(a_actor);
+	}
+	return commit(*acc->second);
 }
@@ -5,6 +5,9 @@
 #include "SingletonBase.h"
 
 #include "ActorAppearanceUpdator.h"
+#include "EquipChangeDebouncer.h"
+#include "FlatActorTable.h"
+#include "ReevaluationScheduler.h"
 
 #include "MutexUtils.h"
 
@@ -14,19 +17,42 @@ namespace daf
 	inline constexpr time_t ActorUpdateInterval_ms = 400;
 	inline constexpr time_t ActorPendingUpdateDelay_ms = 0;
 	inline constexpr float  DiffThreshold = 0.05f;
+	inline constexpr float  ReevaluationBudget_ms = 2.f;         // Time per frame spent reevaluating queued actors
+	inline constexpr time_t ReevaluationMaxDeferral_ms = 1000;  // Queued actors waiting longer go before nearer ones
+	inline constexpr int    MorphEvaluationWorkers = 2;         // Threads evaluating snapshots off the game thread
+	inline constexpr time_t EquipDebounceWindow_ms = 100;       // Equip events closer than this are merged into one reevaluation
+	inline constexpr time_t EquipDebounceMaxDelay_ms = 500;     // Merged equip changes are reevaluated after this at the latest
+	inline constexpr time_t StatsLogInterval_ms = 60000;        // Period of the reevaluation stats in the log, they're also logged on save load
+
+	inline constexpr std::size_t ActorWatchlistCapacity = 4096;  // Watched actors at once, a power of two
+
+	// Watch every loaded NPC, not only the player. The LOD tiers keep distant actors cheap
+	inline constexpr bool WatchAllLoadedActors = false;
+
+	// Reevaluation level of detail of a watched actor, from its distance to the player. Equip changes are always reevaluated at once
+	enum class MorphLOD : std::uint8_t
+	{
+		kNear,
+		kMid,
+		kFar  // Or culled, regular reevaluation is suspended
+	};
+
+	inline constexpr float                 MorphLODNearDistance = 10.f;  // Game units, the world is measured in meters
+	inline constexpr float                 MorphLODMidDistance = 40.f;
+	inline constexpr std::array<time_t, 3> MorphLODUpdateInterval_ms{ ActorUpdateInterval_ms, 2000, -1 };  // -1 suspends the tier
 
 	namespace tokens
 	{
 		inline constexpr std::string conditional_chargen_morph_manager{ "ECOffset_" };
 	}
 
-
 	class ConditionalChargenMorphManager :
 		public utils::SingletonBase<ConditionalChargenMorphManager>,
 		public events::EventDispatcher<events::ArmorOrApparelEquippedEvent>::Listener,
 		public events::EventDispatcher<events::ActorEquipManagerEquipEvent>::Listener,
 		public events::EventDispatcher<events::ActorUpdateEvent>::Listener,
 		public events::EventDispatcher<events::ActorFirstUpdateEvent>::Listener,
+		public events::EventDispatcher<events::ActorLoadedEvent>::Listener,
 		public events::SaveLoadEventDispatcher::Listener
 	{
 		friend class utils::SingletonBase<ConditionalChargenMorphManager>;
@@ -42,26 +68,35 @@ namespace daf
 
 		void OnEvent(const events::ActorFirstUpdateEvent& a_event, events::EventDispatcher<events::ActorFirstUpdateEvent>* a_dispatcher) override;
 
+		void OnEvent(const events::ActorLoadedEvent& a_event, events::EventDispatcher<events::ActorLoadedEvent>* a_dispatcher) override;
+
 		void OnEvent(const events::SaveLoadEvent& a_event, events::EventDispatcher<events::SaveLoadEvent>* a_dispatcher) override;
 
 		void Watch(RE::Actor* a_actor, bool a_pendingUpdate = true)
 		{
 			if (a_actor) {
-				tbb::concurrent_hash_map<RE::TESFormID, time_t>::accessor acc;
-				if (!m_actor_watchlist.find(acc, a_actor->formID)) {
-					m_actor_watchlist.insert(acc, { a_actor->formID, 0 });
+				auto state = m_actor_watchlist.Insert(a_actor->formID);
+				if (!state) {
+					logger::warn("Watch(): actor watchlist has no free record, {} isn't watched", utils::make_str(a_actor));
+					return;
+				}
+
+				if (a_pendingUpdate) {  // Debounced like an equip change, so equip events right after watching merge into it
+					auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+					m_equip_changes.Add(a_actor, now, nullptr);
+					state->equip_pending.store(true, std::memory_order_release);
 				}
-			}
-			if (a_pendingUpdate) {
-				m_actors_pending_reevaluation.insert(a_actor);
 			}
 		}
 
 		void Unwatch(RE::Actor* a_actor)
 		{
 			if (a_actor) {
-				std::lock_guard lock(m_actor_watchlist_erase_lock);
-				m_actor_watchlist.erase(a_actor->formID);
+				m_actor_watchlist.Erase(a_actor->formID);
+				m_actor_contexts.erase(a_actor->formID);
+				m_actor_sessions.erase(a_actor->formID);
+				m_equip_changes.Cancel(a_actor);
+				m_scheduler.Cancel(a_actor->formID);
 			}
 		}
 
@@ -72,20 +107,186 @@ namespace daf
 			events::ActorUpdatedEventDispatcher::GetSingleton()->EventDispatcher<events::ActorUpdateEvent>::AddStaticListener(this);
 			events::ActorUpdatedEventDispatcher::GetSingleton()->EventDispatcher<events::ActorFirstUpdateEvent>::AddStaticListener(this);
 			events::SaveLoadEventDispatcher::GetSingleton()->AddStaticListener(this);
+			events::ActorLoadedEventDispatcher::GetSingleton()->AddStaticListener(this);  // Pending work of unloaded actors is dropped
 		}
 
 		bool ReevaluateActorMorph(RE::Actor* a_actor);
 
+		// Reevaluations skipped because the actor's snapshot was identical to its last one, and reevaluations actually done
+		std::pair<std::uint64_t, std::uint64_t> GetSnapshotCacheStats() const
+		{
+			return { m_snapshot_cache_hits.load(std::memory_order_relaxed), m_snapshot_cache_misses.load(std::memory_order_relaxed) };
+		}
+
+		struct PushStats
+		{
+			std::uint64_t pushes{ 0 };
+			std::uint64_t rebinds{ 0 };  // Pushes that looked the NPC's morph values up again
+			std::uint64_t morphs_written{ 0 };
+			std::uint64_t critical_ns{ 0 };  // Time spent writing into NPCs, see DynamicMorphSession::WriteStats
+			std::uint64_t max_critical_ns{ 0 };
+		};
+
+		// Morph pushes and the time they held the NPC's data
+		PushStats GetPushStats() const
+		{
+			return { m_push_count.load(std::memory_order_relaxed), m_push_rebinds.load(std::memory_order_relaxed),
+				m_push_morphs_written.load(std::memory_order_relaxed), m_push_critical_ns.load(std::memory_order_relaxed),
+				m_push_max_critical_ns.load(std::memory_order_relaxed) };
+		}
+
+		// Actors granted a reevaluation per frame, frames over ReevaluationBudget_ms and requests dropped for unloaded actors
+		ReevaluationScheduler::Stats GetSchedulerStats() const
+		{
+			return m_scheduler.GetStats();
+		}
+
+		// Logs the stats gathered since the game started
+		void LogStats() const;
+
 	private:
-		ConditionalChargenMorphManager(){};
+		ConditionalChargenMorphManager()
+		{
+			m_actor_watchlist.Insert(0x14);  // Player_ref
+		}
+
+		// Equipment changes waiting for their debounce window to close
+		EquipChangeDebouncer m_equip_changes;
+
+		inline static constexpr std::uint32_t NoFrame = std::numeric_limits<std::uint32_t>::max();
+
+		// Looked up on every actor update, most actors aren't watched so a miss must stay cheap
+		struct WatchState
+		{
+			std::atomic<time_t>        last_update{ 0 };
+			std::atomic<MorphLOD>      lod{ MorphLOD::kNear };
+			std::atomic<std::uint32_t> frame{ NoFrame };              // m_frame at the actor's last update
+			std::atomic<bool>          equip_pending{ false };         // m_equip_changes holds a change of the actor
+			std::atomic<bool>          reevaluation_granted{ false };  // m_scheduler granted the actor its reevaluation this frame
+			std::atomic<bool>          evaluation_ready{ false };      // An evaluated job waits in the actor's ActorContext
 
-		mutex::NonReentrantSpinLock               m_actors_pending_reevaluation_erase_lock;
-		tbb::concurrent_unordered_set<RE::Actor*> m_actors_pending_reevaluation;
+			void Reset()
+			{
+				last_update.store(0, std::memory_order_relaxed);
+				lod.store(MorphLOD::kNear, std::memory_order_relaxed);
+				frame.store(NoFrame, std::memory_order_relaxed);
+				equip_pending.store(false, std::memory_order_relaxed);
+				reevaluation_granted.store(false, std::memory_order_relaxed);
+				evaluation_ready.store(false, std::memory_order_relaxed);
+			}
+		};
+
+		utils::FlatActorTable<WatchState, ActorWatchlistCapacity> m_actor_watchlist;
+
+		// Snapshot taken on the actor's own update, evaluated on m_evaluation_arena with the other jobs of its ruleset,
+		// then committed from the actor's next update.
+		// Only keeps the actor's form id, the actor may be unloaded or deleted before the job is done
+		struct EvaluationJob
+		{
+			RE::TESFormID                                              form_id{ 0 };
+			std::shared_ptr<MorphEvaluationRuleSet>                    ruleset;
+			std::unique_ptr<MorphEvaluationRuleSet::EvaluationContext> context;
+			MorphEvaluationRuleSet::ResultTable                        results;
+			std::uint64_t                                              serial{ 0 };
+			std::uint32_t                                              epoch{ 0 };
+			bool                                                       forced{ false };
+		};
+
+		// Last evaluation of each actor, lets the ruleset recompute only the morphs whose inputs changed.
+		// The context is lent to the evaluation job of the actor while it runs off the game thread,
+		// the finished job waits here until the actor's next update commits it.
+		struct ActorContext
+		{
+			std::unique_ptr<MorphEvaluationRuleSet::EvaluationContext> context;
+			std::uint64_t                                              in_flight{ 0 };  // Serial of the job holding the context, 0 if none
+			std::unique_ptr<EvaluationJob>                             evaluated;
+		};
+
+		tbb::concurrent_hash_map<RE::TESFormID, ActorContext> m_actor_contexts;
+
+		// Morph sessions of watched actors, kept between reevaluations so a commit only touches the morphs the rules target.
+		// Dropped on 3D reload and save load, and snapshotted again when DynamicMorphSession::IsCurrent() fails.
+		tbb::concurrent_hash_map<RE::TESFormID, std::unique_ptr<DynamicMorphSession>> m_actor_sessions;
+
+		enum class Submission : std::uint8_t
+		{
+			kSubmitted,
+			kUnchanged,    // No ruleset, or same snapshot as the last evaluation
+			kBusy,         // The actor's previous job hasn't been committed yet
+			kSynchronous   // The ruleset isn't compiled, evaluate it with ReevaluateActorMorph()
+		};
+
+		tbb::task_arena            m_evaluation_arena{ MorphEvaluationWorkers, 0 };
+		std::atomic<std::uint64_t> m_next_job_serial{ 1 };
+		std::atomic<std::uint32_t> m_evaluation_epoch{ 0 };  // Bumped on save load, older jobs are dropped
+
+		// Snapshotted this frame, dispatched at the start of the next one
+		tbb::concurrent_queue<std::unique_ptr<EvaluationJob>> m_submitted_jobs;
+
+		// Watched actors due for reevaluation. The first watched actor updating in a frame picks which of them fit
+		// the frame's budget, each picked actor then snapshots itself on its own update, see ReevaluateGranted()
+		ReevaluationScheduler       m_scheduler;
+		mutex::NonReentrantSpinLock m_scheduler_process_lock;
+
+		// Frames seen by watched actors. A watched actor updating twice in the same frame means a new frame started
+		std::atomic<std::uint32_t> m_frame{ 0 };
+		time_t                     m_last_stats_log{ 0 };  // Only used under m_scheduler_process_lock
+
+		std::atomic<std::uint64_t> m_snapshot_cache_hits{ 0 };
+		std::atomic<std::uint64_t> m_snapshot_cache_misses{ 0 };
 
-		std::mutex                                      m_actor_watchlist_erase_lock;
-		tbb::concurrent_hash_map<RE::TESFormID, time_t> m_actor_watchlist{ { 0x14, 0 } };  // Player_ref
+		std::atomic<std::uint64_t> m_push_count{ 0 };
+		std::atomic<std::uint64_t> m_push_rebinds{ 0 };
+		std::atomic<std::uint64_t> m_push_morphs_written{ 0 };
+		std::atomic<std::uint64_t> m_push_critical_ns{ 0 };
+		std::atomic<std::uint64_t> m_push_max_critical_ns{ 0 };
+
+		void RecordPush(const DynamicMorphSession::WriteStats& a_write)
+		{
+			m_push_count.fetch_add(1, std::memory_order_relaxed);
+			m_push_rebinds.fetch_add(a_write.rebound, std::memory_order_relaxed);
+			m_push_morphs_written.fetch_add(a_write.written, std::memory_order_relaxed);
+			m_push_critical_ns.fetch_add(a_write.elapsed_ns, std::memory_order_relaxed);
+			auto max_ns = m_push_max_critical_ns.load(std::memory_order_relaxed);
+			while (a_write.elapsed_ns > max_ns && !m_push_max_critical_ns.compare_exchange_weak(max_ns, a_write.elapsed_ns, std::memory_order_relaxed)) {
+			}
+		}
 
 		mutex::NonReentrantSpinLock m_menu_actor_last_update_time_lock;
 		time_t                      m_menu_actor_last_update_time{ 0 };
+
+		static MorphLOD GetLOD(RE::Actor* a_actor);
+
+		// True for the one watched actor whose update starts a new frame. Doesn't depend on the player, which doesn't
+		// update in some menus or while disabled, as long as any watched actor updates the scheduler keeps going
+		bool StartsFrame(WatchState& a_state);
+
+		// Grants queued actors their reevaluation until ReevaluationBudget_ms is spent, the rest waits for the next frame.
+		// Only reads the queue, the granted actors snapshot themselves on their own update. Called from the update that starts the frame.
+		void ProcessScheduledReevaluations(time_t a_now);
+
+		// Called from a_actor's own update once it was granted, snapshots it and reports the time spent to m_scheduler.
+		// Only the snapshots count against the budget, evaluation runs on the workers.
+		void ReevaluateGranted(RE::Actor* a_actor, time_t a_now);
+
+		// Snapshots the actor and queues its evaluation in m_submitted_jobs, must be called from the actor's own update:
+		// the snapshot reads the NPC's morphs, which only the actor's own update writes
+		Submission SubmitActorMorphEvaluation(RE::Actor* a_actor, bool a_forced);
+
+		// Hands the jobs snapshotted last frame to m_evaluation_arena, jobs sharing a ruleset are evaluated in one batch
+		void DispatchSubmittedJobs();
+
+		// Evaluates jobs of the same ruleset on a worker and parks each one in its actor's context until the actor commits it
+		void EvaluateJobs(std::vector<std::unique_ptr<EvaluationJob>>& a_jobs);
+
+		// Called from a_actor's own update, pushes the results of its finished job and updates its appearance if they changed.
+		// The job is dropped if the actor was reloaded, unloaded or unwatched since it was snapshotted.
+		void CommitEvaluatedMorphs(RE::Actor* a_actor);
+
+		// Drops the actor's finished or running job, its next evaluation starts from a fresh snapshot
+		void DropEvaluation(RE::TESFormID a_formID);
+
+		// Applies evaluated morph results to the actor, returns true if the diff reaches DiffThreshold and they were pushed
+		bool CommitMorphResults(RE::Actor* a_actor, const MorphEvaluationRuleSet::ResultTable& a_results);
 	};
 }
\ No newline at end of file
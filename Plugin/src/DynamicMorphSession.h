@@ -1,18 +1,13 @@
 #pragma once
 #include "SFEventHandler.h"
+#include "MorphNameRegistry.h"
 
 namespace daf
 {
-	inline constexpr std::string_view overweightMorphName{ "Overweight" };
-	inline constexpr std::string_view strongMorphName{ "Strong" };
-	inline constexpr std::string_view thinMorphName{ "Thin" };
-
-	namespace tokens
-	{
-		inline constexpr std::string general_offset{ "ECOffset_" };
-	}
-
-	// A mini git session for actor morphs
+	// A mini git session for actor morphs.
+	// Sessions may be kept per actor across reevaluations: each round starts from the morphs pushed by the last one,
+	// and only the morphs it commits are compared and written. Check IsCurrent() before reusing one.
+	// Morphs live in slots, snapshot and evaluated values are two parallel float arrays indexed by slot.
 	class DynamicMorphSession
 	{
 	public:
@@ -23,24 +18,19 @@ namespace daf
 			L2_Norm
 		};
 
-		struct MorphValue
+		struct Norms
 		{
-			MorphValue() = default;
-			MorphValue(float snapshot) :
-				snapshot(snapshot), evaluated(snapshot) {}
-
-			float snapshot{ 0.f };
-			float evaluated{ 0.f };
-
-			float Diff()
-			{
-				return evaluated - snapshot;
-			}
+			float max{ 0.f };
+			float l1{ 0.f };
+			float l2_squared{ 0.f };
+		};
 
-			float DiffAbs()
-			{
-				return std::abs(Diff());
-			}
+		// Last push, timed from reading the NPC to recording its new version
+		struct WriteStats
+		{
+			std::uint32_t written{ 0 };
+			bool          rebound{ false };  // The NPC's values moved or morphs were added, their pointers were looked up again
+			std::uint64_t elapsed_ns{ 0 };
 		};
 
 		DynamicMorphSession(std::string a_token, RE::Actor* a_actor, DiffMode a_diffMode = DiffMode::Max_Norm) :
@@ -50,178 +40,505 @@ namespace daf
 			Snapshot(a_actor);
 		}
 
-		~DynamicMorphSession()
+		DynamicMorphSession(const DynamicMorphSession&) = delete;
+		DynamicMorphSession& operator=(const DynamicMorphSession&) = delete;
+
+		// False if the actor's morphs may have changed behind the session's back since its last snapshot or push:
+		// another actor or NPC, a replaced, resized or rehashed shapeBlendData, or an external write to a morph this session pushed.
+		// Only reads the morphs the session owns, take a new Snapshot() when it fails.
+		bool IsCurrent(RE::Actor* a_actor) const
 		{
-			for (auto& ptr : _new_strings) {
-				delete[] ptr;
+			auto npc = a_actor == m_actor ? a_actor->GetNPC() : nullptr;
+			if (!npc || npc != m_npc || npc->shapeBlendData != m_shape_blend_data) {
+				return false;
+			}
+
+			if (npc->morphWeight.fat != m_snapshot[m_weight_slots[0]] ||
+				npc->morphWeight.muscular != m_snapshot[m_weight_slots[1]] ||
+				npc->morphWeight.thin != m_snapshot[m_weight_slots[2]]) {
+				return false;
 			}
+
+			if (m_shape_blend_data) {
+				if (m_shape_blend_data->size() != m_shape_blend_size || FirstValue(m_shape_blend_data) != m_first_value) {
+					return false;
+				}
+
+				auto& registry = MorphNameRegistry::GetSingleton();
+				for (auto slot : m_owned) {
+					auto it = m_shape_blend_data->find(registry.Get(m_slots[slot].id).fixed_name);
+					if (it == m_shape_blend_data->end() || it->value != m_snapshot[slot]) {
+						return false;
+					}
+				}
+			}
+
+			return true;
 		}
 
-		inline std::string_view GetOffsetName(std::string_view morph_name)
+		// Forgets every morph and reads the actor's morphs again
+		bool Snapshot(RE::Actor* a_actor)
 		{
-			auto offset_name = offsetPrefix + morph_name.data();
-			if (auto it = m_morph_offset_names.find(offset_name); it != m_morph_offset_names.end()) {
-				return it->first;
+			m_snapshot.clear();
+			m_evaluated.clear();
+			m_slots.clear();
+			m_slot_index.clear();
+			std::ranges::fill(m_id_slots, NoSlot);
+			m_offsets.clear();
+			m_names.clear();
+			m_dirty.clear();
+			m_owned.clear();
+			m_running = {};
+
+			m_actor = a_actor;
+
+			auto& registry = MorphNameRegistry::GetSingleton();
+
+			{ // Critical section
+				auto npc = m_actor->GetNPC();
+				m_npc = npc;
+				if (!npc) {
+					return false;
+				}
+
+				m_weight_slots = { AddSlot(overweightMorphName, NoMorphID, npc->morphWeight.fat),
+					AddSlot(strongMorphName, NoMorphID, npc->morphWeight.muscular),
+					AddSlot(thinMorphName, NoMorphID, npc->morphWeight.thin) };
+				BindWeightValues(npc);
+
+				if (npc->shapeBlendData) {
+					auto& morph_data = *npc->shapeBlendData;
+					for (auto& [morph_name, offset] : morph_data) {
+						// Game strings may be released while the session is kept, so names are owned by the registry or the session
+						std::string_view name(morph_name);
+						auto             id = registry.Find(name);
+						if (auto it = m_slot_index.find(name); it != m_slot_index.end()) {  // A weight morph, written to morphWeight
+							m_snapshot[it->second] = m_evaluated[it->second] = offset;
+						} else {
+							auto slot = AddSlot(id != NoMorphID ? std::string_view(registry.Get(id).name) : std::string_view(*m_names.emplace(name).first), id, offset);
+							BindValue(slot, &offset, &morph_name);
+						}
+					}
+				}
+				RecordVersion(npc);
+			} // End of critical section
+
+			for (std::uint32_t slot = 0, num_slots = static_cast<std::uint32_t>(m_slots.size()); slot < num_slots; ++slot) {
+				if (auto name = m_slots[slot].name; name.starts_with(offsetPrefix)) {
+					AddOffset(slot, Slot(name.substr(offsetPrefix.size())));
+				}
 			}
-			return _find_or_alloc(offset_name);
+
+			return true;
 		}
 
-		void MorphOffsetCommit(std::string morph_name, float offset)
+		// Commits take MorphNameRegistry ids, whose offset morphs use tokens::general_offset as prefix.
+		// Offset ids are precomputed by the registry and ids map to slots through a flat array, so once a morph has a slot
+		// its commits neither hash nor allocate.
+		void MorphOffsetCommit(MorphID morph, float offset)
 		{
-			auto offset_name = GetOffsetName(morph_name);
-			auto morph_name_sv = _find_or_alloc(morph_name);
+			auto offset_slot = Slot(MorphNameRegistry::GetSingleton().Get(morph).offset_id);
+			SetEvaluated(offset_slot, m_evaluated[offset_slot] + offset);
 
-			m_morph_snapshot[offset_name].evaluated += offset;
-			m_morph_snapshot[morph_name_sv].evaluated += offset;
+			auto slot = Slot(morph);
+			SetEvaluated(slot, m_evaluated[slot] + offset);
 
-			m_morph_offset_names[offset_name] = morph_name_sv;
+			AddOffset(offset_slot, slot);
 		}
 
-		void MorphTargetCommit(std::string morph_name, float target)
+		void MorphTargetCommit(MorphID morph, float target)
 		{
-			auto& entry = m_morph_snapshot[morph_name];
-
-			entry.evaluated = target;
+			auto slot = Slot(morph);
+			SetEvaluated(slot, target);
 
-			if (float diff = entry.Diff(); diff != 0.f) {
-				auto offset_name = GetOffsetName(morph_name);
-				auto morph_name_sv = _find_or_alloc(morph_name);
-				m_morph_snapshot[offset_name].evaluated += diff;
-				m_morph_offset_names[offset_name] = morph_name_sv;
+			if (float diff = m_evaluated[slot] - m_snapshot[slot]; diff != 0.f) {
+				auto offset_slot = Slot(MorphNameRegistry::GetSingleton().Get(morph).offset_id);
+				SetEvaluated(offset_slot, m_evaluated[offset_slot] + diff);
+				AddOffset(offset_slot, slot);
 			}
 		}
 
 		void RevertCommits()
 		{
-			for (auto& [morph_name, target] : m_morph_snapshot) {
-				target.evaluated = target.snapshot;
+			for (auto slot : m_dirty) {
+				m_evaluated[slot] = m_snapshot[slot];
+				m_slots[slot].dirty = false;
 			}
+			m_dirty.clear();
+			m_running = {};
 		}
 
 		// Revert all morph offsets
 		void RestoreMorph()
 		{
-			for (auto& [offset_name, morph_name] : m_morph_offset_names) {
-				auto& entry = m_morph_snapshot[offset_name];
-				m_morph_snapshot[morph_name].evaluated -= entry.evaluated;
-				entry.evaluated = 0;
+			for (auto [offset_slot, slot] : m_offsets) {
+				if (m_evaluated[offset_slot] == 0.f) {
+					continue;
+				}
+				SetEvaluated(slot, m_evaluated[slot] - m_evaluated[offset_slot]);
+				SetEvaluated(offset_slot, 0.f);
+			}
+		}
+
+		// Max, L1 and squared L2 norm of a_values in a single pass. Each norm keeps one accumulator per lane
+		// so the loop has no dependency chain and the compiler vectorizes it, the same way RuleProgram::RunBatch() is.
+		static Norms ComputeNorms(const float* a_values, std::size_t a_size)
+		{
+			constexpr std::size_t Lanes = 8;
+
+			std::array<float, Lanes> max{};
+			std::array<float, Lanes> l1{};
+			std::array<float, Lanes> l2{};
+
+			std::size_t i = 0;
+			for (; i + Lanes <= a_size; i += Lanes) {
+				for (std::size_t lane = 0; lane < Lanes; ++lane) {
+					float value = a_values[i + lane];
+					float abs = std::abs(value);
+					max[lane] = std::max(max[lane], abs);
+					l1[lane] += abs;
+					l2[lane] += value * value;
+				}
+			}
+			for (; i < a_size; ++i) {
+				float value = a_values[i];
+				float abs = std::abs(value);
+				max[0] = std::max(max[0], abs);
+				l1[0] += abs;
+				l2[0] += value * value;
+			}
+
+			Norms norms;
+			for (std::size_t lane = 0; lane < Lanes; ++lane) {
+				norms.max = std::max(norms.max, max[lane]);
+				norms.l1 += l1[lane];
+				norms.l2_squared += l2[lane];
 			}
+			return norms;
+		}
+
+		// Untouched morphs are still equal to their snapshot, only the dirty slots are compared
+		Norms DiffNorms()
+		{
+			m_diffs.resize(m_dirty.size());
+			for (std::size_t i = 0; i < m_dirty.size(); ++i) {
+				m_diffs[i] = m_evaluated[m_dirty[i]] - m_snapshot[m_dirty[i]];
+			}
+			return ComputeNorms(m_diffs.data(), m_diffs.size());
 		}
 
 		float Diff()
 		{
-			float diff = 0.f;
+			auto norms = DiffNorms();
 			switch (diffMode) {
+			case DiffMode::L1_Norm:
+				return norms.l1;
+			case DiffMode::L2_Norm:
+				return std::sqrt(norms.l2_squared);
 			case DiffMode::Max_Norm:
-				for (auto& [morph_name, target] : m_morph_snapshot) {
-					diff = std::max(diff, target.DiffAbs());
-				}
-				return diff;
+			default:
+				return norms.max;
+			}
+		}
+
+		// Same decision as Diff() >= a_threshold, without computing the whole norm. O(1) for L1 and L2 through the running
+		// accumulators. For Max_Norm the running bound rejects most unchanged rounds at once, otherwise the dirty slots
+		// are scanned until the first one reaching a_threshold.
+		bool DiffReaches(float a_threshold) const
+		{
+			switch (diffMode) {
 			case DiffMode::L1_Norm:
-				for (auto& [morph_name, target] : m_morph_snapshot) {
-					diff += target.DiffAbs();
-				}
-				return diff;
+				return m_running.l1 >= a_threshold;
 			case DiffMode::L2_Norm:
-				for (auto& [morph_name, target] : m_morph_snapshot) {
-					diff += target.Diff() * target.Diff();
+				return std::sqrt(std::max(m_running.l2_squared, 0.f)) >= a_threshold;
+			case DiffMode::Max_Norm:
+			default:
+				if (m_running.max < a_threshold) {
+					return false;
+				}
+				for (auto slot : m_dirty) {
+					if (std::abs(m_evaluated[slot] - m_snapshot[slot]) >= a_threshold) {
+						return true;
+					}
 				}
-				return std::sqrt(diff);
+				return false;
 			}
 		}
 
-		// Reduce resource occupation time and avoid race condition
+		// Pushes the commits if their Diff() is at least a_minDiffToCommit, returns the diff
 		float PushCommits(float a_minDiffToCommit = 0.f)
 		{
 			float diff = Diff();
 
-			if (diff < a_minDiffToCommit) {
+			if (diff < a_minDiffToCommit) {  // Not worth an update, the next round starts from the same snapshot
+				RevertCommits();
 				return diff;
 			}
 
-			std::unordered_map<std::string_view, float> commit_batch;
+			Write();
+			return diff;
+		}
 
-			for (auto& [morph_name, morph_value] : m_morph_snapshot) {
-				if (morph_value.Diff() != 0.f) {
-					commit_batch[morph_name] = morph_value.evaluated;
-					morph_value.snapshot = morph_value.evaluated;
-				}
+		// Pushes the commits if their diff reaches a_threshold, see DiffReaches(). Returns true if they were pushed
+		bool PushCommitsIfReaches(float a_threshold)
+		{
+			if (!DiffReaches(a_threshold)) {
+				RevertCommits();
+				return false;
 			}
 
-			
-			{ // Critical section
-				auto npc = m_actor->GetNPC();
-				for (auto& [morph_name, target] : commit_batch) {
-					if (morph_name == overweightMorphName) {
-						npc->morphWeight.fat = target;
-					} else if (morph_name == strongMorphName) {
-						npc->morphWeight.muscular = target;
-					} else if (morph_name == thinMorphName) {
-						npc->morphWeight.thin = target;
-					} else {
-						if (!npc->shapeBlendData) {
-							npc->shapeBlendData = new RE::BSTHashMap<RE::BSFixedStringCS, float>();
-						}
-
-						(*npc->shapeBlendData)[morph_name] = target;
-					}
-				}
-			} // End of critical section
-			
+			Write();
+			return true;
+		}
 
-			return diff;
+		const WriteStats& GetLastWrite() const
+		{
+			return m_last_write;
 		}
 
 		DiffMode          diffMode = DiffMode::Max_Norm;
 		const std::string offsetPrefix;
 
 	private:
-		RE::Actor*                                             m_actor;
-		std::unordered_map<std::string_view, MorphValue>       m_morph_snapshot;
-		std::unordered_map<std::string_view, std::string_view> m_morph_offset_names;
-		std::vector<char*>                                     _new_strings;
-
-		std::unordered_set<std::string> m_string_pool;
-
 		// Reduce resource occupation time and avoid race condition
-		bool Snapshot(RE::Actor* a_actor)
+		void Write()
 		{
-			m_actor = a_actor;
+			auto& registry = MorphNameRegistry::GetSingleton();
+
+			// Compact list of the slots to write, their snapshot becomes the pushed value
+			m_commit_slots.clear();
+			for (auto slot : m_dirty) {
+				auto& info = m_slots[slot];
+				info.dirty = false;
+				if (m_evaluated[slot] - m_snapshot[slot] == 0.f) {
+					continue;
+				}
+
+				m_commit_slots.emplace_back(slot);
+				m_snapshot[slot] = m_evaluated[slot];
 
+				// Weight morphs are checked through m_weight_slots
+				if (info.id != NoMorphID && !info.owned && registry.Get(info.id).weight == MorphNameRegistry::WeightMorph::kNone) {
+					info.owned = true;
+					m_owned.emplace_back(slot);
+				}
+			}
+			m_dirty.clear();
+			m_running = {};
+
+			// N changed morphs are N stores through the pointers bound at snapshot time, they are looked up again if the NPC's
+			// morphs moved since the last snapshot or push, or if an entry now holds another morph (erased and reused by someone
+			// else, which keeps the size). Morphs new to shapeBlendData are inserted first since inserting may move the other entries
 			{ // Critical section
+				auto start = std::chrono::steady_clock::now();
 				auto npc = m_actor->GetNPC();
-				if (!npc) {
-					return false;
+
+				m_last_write = { static_cast<std::uint32_t>(m_commit_slots.size()) };
+				if (npc != m_npc || npc->shapeBlendData != m_shape_blend_data ||
+					(m_shape_blend_data && (m_shape_blend_data->size() != m_shape_blend_size || FirstValue(m_shape_blend_data) != m_first_value)) ||
+					!std::ranges::all_of(m_commit_slots, [this](std::uint32_t a_slot) { return IsValueBound(a_slot); })) {
+					BindValues(npc);
 				}
 
-				m_morph_snapshot[overweightMorphName] = npc->morphWeight.fat;
-				m_morph_snapshot[strongMorphName] = npc->morphWeight.muscular;
-				m_morph_snapshot[thinMorphName] = npc->morphWeight.thin;
+				bool inserted = false;
+				for (auto slot : m_commit_slots) {
+					if (m_slots[slot].value) {
+						continue;
+					}
+					if (!npc->shapeBlendData) {
+						npc->shapeBlendData = new RE::BSTHashMap<RE::BSFixedStringCS, float>();
+					}
 
-				if (npc->shapeBlendData) {
-					auto& morph_data = *npc->shapeBlendData;
-					for (auto& [morph_name, offset] : morph_data) {
-						m_morph_snapshot[morph_name] = offset;
+					// Registered morphs reuse their game string, only morphs restored from the snapshot build one
+					if (auto id = m_slots[slot].id; id != NoMorphID) {
+						(*npc->shapeBlendData)[registry.Get(id).fixed_name] = m_snapshot[slot];
+					} else {
+						(*npc->shapeBlendData)[m_slots[slot].name] = m_snapshot[slot];
 					}
+					inserted = true;
+				}
+				if (inserted) {
+					BindValues(npc);
 				}
-			} // End of critical section
 
-			for (auto& [morph_name, target] : m_morph_snapshot) {
-				if (morph_name.starts_with(offsetPrefix)) {
-					m_morph_offset_names[morph_name] = morph_name.data() + offsetPrefix.size();
+				for (auto slot : m_commit_slots) {
+					*m_slots[slot].value = m_snapshot[slot];
 				}
+				RecordVersion(npc);
+
+				m_last_write.elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			} // End of critical section
+		}
+
+		struct SlotInfo
+		{
+			std::string_view name;                 // Owned by MorphNameRegistry or m_names
+			MorphID          id{ NoMorphID };      // Known once the morph is committed by id, lets PushCommits() use its registered handle
+			bool             dirty{ false };       // Listed in m_dirty, may differ from its snapshot
+			bool             owned{ false };       // Pushed to shapeBlendData by this session, checked by IsCurrent()
+			bool             is_offset{ false };   // Listed in m_offsets
+			float*           value{ nullptr };     // Value in the NPC, null if shapeBlendData doesn't have the morph yet
+			const RE::BSFixedStringCS* value_key{ nullptr };  // Key of the shapeBlendData entry holding value, null for weight morphs
+			const char*                key_data{ nullptr };   // Game string value_key held when bound, see IsValueBound()
+		};
+
+		RE::Actor* m_actor{ nullptr };
+
+		// Indexed by slot
+		std::vector<float>    m_snapshot;
+		std::vector<float>    m_evaluated;
+		std::vector<SlotInfo> m_slots;
+
+		static constexpr std::uint32_t NoSlot = std::numeric_limits<std::uint32_t>::max();
+
+		std::unordered_map<std::string_view, std::uint32_t>   m_slot_index;
+		std::vector<std::uint32_t>                            m_id_slots;  // Indexed by MorphID, NoSlot if the morph has no slot yet
+		std::vector<std::pair<std::uint32_t, std::uint32_t>> m_offsets;  // Offset slot, slot of the morph it offsets
+		std::set<std::string, std::less<>>                    m_names;    // Snapshotted morphs unknown to MorphNameRegistry
+
+		std::vector<std::uint32_t> m_dirty;         // Slots that may differ from their snapshot since the last push
+		std::vector<std::uint32_t> m_commit_slots;  // Scratch of PushCommits()
+		std::vector<float>         m_diffs;         // Scratch of DiffNorms()
+
+		// Norms of the dirty slots, updated by every change of an evaluated value. max only grows within a round,
+		// so it is an upper bound of the Max norm. Reset when the dirty slots are pushed or reverted
+		Norms m_running;
+
+		// State of the NPC after the last snapshot or push, see IsCurrent()
+		RE::TESNPC*                                 m_npc{ nullptr };
+		RE::BSTHashMap<RE::BSFixedStringCS, float>* m_shape_blend_data{ nullptr };
+		std::size_t                                 m_shape_blend_size{ 0 };
+		const float*                                m_first_value{ nullptr };  // Moves when shapeBlendData reallocates its entries
+		std::array<std::uint32_t, 3>                m_weight_slots{};  // Overweight, Strong, Thin
+		std::vector<std::uint32_t>                  m_owned;
+
+		WriteStats m_last_write;
+
+		std::uint32_t AddSlot(std::string_view a_name, MorphID a_id, float a_value)
+		{
+			auto slot = static_cast<std::uint32_t>(m_slots.size());
+			m_slots.emplace_back(a_name);
+			m_snapshot.emplace_back(a_value);
+			m_evaluated.emplace_back(a_value);
+			m_slot_index.emplace(a_name, slot);
+			BindID(slot, a_id);
+			return slot;
+		}
+
+		void BindID(std::uint32_t a_slot, MorphID a_id)
+		{
+			if (a_id == NoMorphID) {
+				return;
+			}
+			m_slots[a_slot].id = a_id;
+			if (a_id >= m_id_slots.size()) {
+				m_id_slots.resize(std::max<std::size_t>(a_id + 1, MorphNameRegistry::GetSingleton().Size()), NoSlot);
 			}
+			m_id_slots[a_id] = a_slot;
+		}
 
-			return true;
+		// Slot of a_name, a morph missing from the snapshot starts at 0. a_name must outlive the session
+		std::uint32_t Slot(std::string_view a_name, MorphID a_id = NoMorphID)
+		{
+			if (auto it = m_slot_index.find(a_name); it != m_slot_index.end()) {
+				BindID(it->second, a_id);
+				return it->second;
+			}
+			return AddSlot(a_name, a_id, 0.f);
+		}
+
+		// Slot of a registered morph, a single array read once the morph has one
+		std::uint32_t Slot(MorphID a_id)
+		{
+			if (a_id < m_id_slots.size() && m_id_slots[a_id] != NoSlot) {
+				return m_id_slots[a_id];
+			}
+			return Slot(MorphNameRegistry::GetSingleton().Get(a_id).name, a_id);
+		}
+
+		void Touch(std::uint32_t a_slot)
+		{
+			if (!m_slots[a_slot].dirty) {
+				m_slots[a_slot].dirty = true;
+				m_dirty.emplace_back(a_slot);
+			}
+		}
+
+		void SetEvaluated(std::uint32_t a_slot, float a_value)
+		{
+			Touch(a_slot);
+
+			float old_diff = m_evaluated[a_slot] - m_snapshot[a_slot];
+			float new_diff = a_value - m_snapshot[a_slot];
+			m_running.max = std::max(m_running.max, std::abs(new_diff));
+			m_running.l1 += std::abs(new_diff) - std::abs(old_diff);
+			m_running.l2_squared += new_diff * new_diff - old_diff * old_diff;
+
+			m_evaluated[a_slot] = a_value;
+		}
+
+		void AddOffset(std::uint32_t a_offsetSlot, std::uint32_t a_slot)
+		{
+			if (!m_slots[a_offsetSlot].is_offset) {
+				m_slots[a_offsetSlot].is_offset = true;
+				m_offsets.emplace_back(a_offsetSlot, a_slot);
+			}
+		}
+
+		void RecordVersion(RE::TESNPC* a_npc)
+		{
+			m_npc = a_npc;
+			m_shape_blend_data = a_npc->shapeBlendData;
+			m_shape_blend_size = m_shape_blend_data ? m_shape_blend_data->size() : 0;
+			m_first_value = FirstValue(m_shape_blend_data);
+		}
+
+		static const float* FirstValue(RE::BSTHashMap<RE::BSFixedStringCS, float>* a_morphData)
+		{
+			return a_morphData && a_morphData->begin() != a_morphData->end() ? &a_morphData->begin()->value : nullptr;
+		}
+
+		void BindWeightValues(RE::TESNPC* a_npc)
+		{
+			m_slots[m_weight_slots[0]].value = &a_npc->morphWeight.fat;
+			m_slots[m_weight_slots[1]].value = &a_npc->morphWeight.muscular;
+			m_slots[m_weight_slots[2]].value = &a_npc->morphWeight.thin;
 		}
 
-		std::string_view _find_or_alloc(std::string& _str)
+		// Points every slot at its value in a_npc, one lookup per morph in shapeBlendData
+		void BindValues(RE::TESNPC* a_npc)
 		{
-			auto it = m_string_pool.find(_str);
-			if (it != m_string_pool.end()) {
-				return *it;
+			m_last_write.rebound = true;
+			for (auto& info : m_slots) {
+				info.value = nullptr;
+				info.value_key = nullptr;
+				info.key_data = nullptr;
 			}
-			return *m_string_pool.insert(_str).first;
+			BindWeightValues(a_npc);
+
+			if (a_npc->shapeBlendData) {
+				for (auto& [morph_name, value] : *a_npc->shapeBlendData) {
+					auto it = m_slot_index.find(std::string_view(morph_name));
+					if (it != m_slot_index.end() && std::ranges::find(m_weight_slots, it->second) == m_weight_slots.end()) {
+						BindValue(it->second, &value, &morph_name);
+					}
+				}
+			}
+		}
+
+		void BindValue(std::uint32_t a_slot, float* a_value, const RE::BSFixedStringCS* a_key)
+		{
+			auto& info = m_slots[a_slot];
+			info.value = a_value;
+			info.value_key = a_key;
+			info.key_data = a_key->data();
+		}
+
+		// False if the entry a_slot points to now holds another morph. Game strings are interned, comparing their data is enough
+		bool IsValueBound(std::uint32_t a_slot) const
+		{
+			auto& info = m_slots[a_slot];
+			return !info.value_key || info.value_key->data() == info.key_data;
 		}
 	};
-}
\ No newline at end of file
+}
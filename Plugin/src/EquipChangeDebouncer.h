@@ -0,0 +1,77 @@
+#pragma once
+#include "MutexUtils.h"
+
+namespace daf
+{
+	// Merges the equip and unequip events of an actor into one change, released once no event arrived for a whole window.
+	// Swapping an outfit fires several events per piece over a few frames, they all end up in a single reevaluation.
+	// A change is released after a_maxDelay_ms at the latest, so a steady stream of events can't hold it back forever.
+	class EquipChangeDebouncer
+	{
+	public:
+		struct Change
+		{
+			time_t                     first_event{ 0 };
+			time_t                     last_event{ 0 };
+			std::vector<RE::TESFormID> armors;  // Each changed armor once, in event order
+		};
+
+		// a_armor may be null for changes not caused by a specific armor
+		void Add(RE::Actor* a_actor, time_t a_when, const RE::TESForm* a_armor)
+		{
+			std::lock_guard lock(m_lock);
+			auto [it, inserted] = m_changes.try_emplace(a_actor->formID);
+			auto& change = it->second;
+			if (inserted) {
+				change.first_event = a_when;
+				m_num_changes.fetch_add(1, std::memory_order_relaxed);
+			}
+			change.last_event = std::max(change.last_event, a_when);
+			if (a_armor && std::ranges::find(change.armors, a_armor->formID) == change.armors.end()) {
+				change.armors.emplace_back(a_armor->formID);
+			}
+		}
+
+		// Moves the actor's change into a_change if its window is closed
+		bool Take(RE::Actor* a_actor, time_t a_now, time_t a_window_ms, time_t a_maxDelay_ms, Change& a_change)
+		{
+			if (m_num_changes.load(std::memory_order_relaxed) == 0) {  // Called on every actor update, skip the lock when idle
+				return false;
+			}
+
+			std::lock_guard lock(m_lock);
+			auto            it = m_changes.find(a_actor->formID);
+			if (it == m_changes.end()) {
+				return false;
+			}
+			if (a_now - it->second.last_event < a_window_ms && a_now - it->second.first_event < a_maxDelay_ms) {
+				return false;
+			}
+
+			a_change = std::move(it->second);
+			m_changes.erase(it);
+			m_num_changes.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		void Cancel(RE::Actor* a_actor)
+		{
+			std::lock_guard lock(m_lock);
+			if (m_changes.erase(a_actor->formID)) {
+				m_num_changes.fetch_sub(1, std::memory_order_relaxed);
+			}
+		}
+
+		void Clear()
+		{
+			std::lock_guard lock(m_lock);
+			m_changes.clear();
+			m_num_changes.store(0, std::memory_order_relaxed);
+		}
+
+	private:
+		mutex::NonReentrantSpinLock               m_lock;
+		std::unordered_map<RE::TESFormID, Change> m_changes;
+		std::atomic<std::size_t>                  m_num_changes{ 0 };
+	};
+}
@@ -0,0 +1,243 @@
+#pragma once
+#include "MutexUtils.h"
+
+namespace utils
+{
+	// Open-addressed table of per-actor records keyed by form id, sized once for every actor loaded at the same time.
+	// Find() is lock-free: keys are probed linearly in their own dense array, sixteen per cache line, so looking up an actor
+	// that isn't in the table usually costs a single cache line. Insert() and Erase() are serialized on a spinlock.
+	// Records never move, keys point to them through an index. Erasing leaves a tombstone that a later Insert() reuses,
+	// once tombstones reach MaxTombstones the keys are rehashed in place so misses don't have to probe past them.
+	// Find() retries while keys are being written. A record returned by Find() may be erased while the caller still uses it,
+	// so freed records are reused first in, first out and only RecordReuseDelay after they were freed: a late write lands in
+	// a free record instead of the state of another actor. Records are reused after calling _Record_T::Reset(),
+	// so record fields read or written by several threads must be atomics.
+	template <class _Record_T, std::size_t _Capacity>
+	class FlatActorTable
+	{
+		static_assert(_Capacity > 1 && std::has_single_bit(_Capacity), "Capacity must be a power of two");
+		static_assert(_Capacity <= std::numeric_limits<std::uint32_t>::max(), "Record indices are 32-bit");
+
+	public:
+		// Longer than anyone keeps a record returned by Find(), which is only used for the event being handled
+		static constexpr std::chrono::milliseconds RecordReuseDelay{ 1000 };
+
+		FlatActorTable()
+		{
+			for (auto& key : m_keys) {
+				key.store(EmptyKey, std::memory_order_relaxed);
+			}
+			for (std::size_t i = 0; i < _Capacity; ++i) {
+				m_free_records[i] = { static_cast<std::uint32_t>(i), {} };
+			}
+			m_num_free = _Capacity;
+		}
+
+		FlatActorTable(const FlatActorTable&) = delete;
+		FlatActorTable& operator=(const FlatActorTable&) = delete;
+
+		_Record_T* Find(RE::TESFormID a_id)
+		{
+			for (;;) {
+				auto version = m_version.load(std::memory_order_acquire);
+				if (version & 1) {  // Rehashing
+					std::this_thread::yield();
+					continue;
+				}
+				auto record = Probe(a_id);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (m_version.load(std::memory_order_relaxed) == version) {
+					return record;
+				}
+			}
+		}
+
+		// Returns the record of a_id, inserting a reset one if needed. nullptr if the table is full, or if every free record
+		// was freed less than RecordReuseDelay ago
+		_Record_T* Insert(RE::TESFormID a_id, bool* a_inserted = nullptr)
+		{
+			if (a_inserted) {
+				*a_inserted = false;
+			}
+			if (a_id == EmptyKey || a_id == ErasedKey) {
+				return nullptr;
+			}
+			if (auto record = Find(a_id); record) {
+				return record;
+			}
+
+			std::lock_guard lock(m_lock);
+			std::size_t     slot = _Capacity;
+			for (std::size_t i = Hash(a_id), probes = 0; probes < _Capacity; i = (i + 1) & Mask, ++probes) {
+				auto key = m_keys[i].load(std::memory_order_relaxed);
+				if (key == a_id) {  // Inserted by another thread meanwhile
+					return &m_records[m_record_indices[i].load(std::memory_order_relaxed)];
+				} else if (key == ErasedKey) {  // Keep probing, a_id may still follow. Reuse the first tombstone otherwise
+					if (slot == _Capacity) {
+						slot = i;
+					}
+				} else if (key == EmptyKey) {
+					if (slot == _Capacity) {
+						slot = i;
+					}
+					break;
+				}
+			}
+			if (slot == _Capacity || m_num_free == 0 || std::chrono::steady_clock::now() - m_free_records[m_free_head].freed < RecordReuseDelay) {
+				return nullptr;
+			}
+
+			if (m_keys[slot].load(std::memory_order_relaxed) == ErasedKey) {
+				--m_num_tombstones;
+			}
+			auto record = m_free_records[m_free_head].index;
+			m_free_head = (m_free_head + 1) & Mask;
+			--m_num_free;
+			m_records[record].Reset();
+
+			BeginWrite();
+			m_record_indices[slot].store(record, std::memory_order_relaxed);
+			m_keys[slot].store(a_id, std::memory_order_relaxed);
+			EndWrite();
+			m_size.fetch_add(1, std::memory_order_relaxed);
+			if (a_inserted) {
+				*a_inserted = true;
+			}
+			return &m_records[record];
+		}
+
+		bool Erase(RE::TESFormID a_id)
+		{
+			std::lock_guard lock(m_lock);
+			for (std::size_t i = Hash(a_id), probes = 0; probes < _Capacity; i = (i + 1) & Mask, ++probes) {
+				auto key = m_keys[i].load(std::memory_order_relaxed);
+				if (key == a_id) {
+					BeginWrite();
+					m_keys[i].store(ErasedKey, std::memory_order_relaxed);
+					EndWrite();
+					FreeRecord(m_record_indices[i].load(std::memory_order_relaxed), std::chrono::steady_clock::now());
+					m_size.fetch_sub(1, std::memory_order_relaxed);
+					if (++m_num_tombstones >= MaxTombstones) {
+						Rehash();
+					}
+					return true;
+				} else if (key == EmptyKey) {
+					return false;
+				}
+			}
+			return false;
+		}
+
+		void Clear()
+		{
+			std::lock_guard lock(m_lock);
+			auto            now = std::chrono::steady_clock::now();
+			BeginWrite();
+			for (std::size_t i = 0; i < _Capacity; ++i) {
+				auto key = m_keys[i].load(std::memory_order_relaxed);
+				if (key != EmptyKey && key != ErasedKey) {
+					FreeRecord(m_record_indices[i].load(std::memory_order_relaxed), now);
+				}
+				m_keys[i].store(EmptyKey, std::memory_order_relaxed);
+			}
+			EndWrite();
+			m_num_tombstones = 0;
+			m_size.store(0, std::memory_order_relaxed);
+		}
+
+		std::size_t Size() const
+		{
+			return m_size.load(std::memory_order_relaxed);
+		}
+
+	private:
+		static constexpr RE::TESFormID EmptyKey = 0;
+		static constexpr RE::TESFormID ErasedKey = std::numeric_limits<RE::TESFormID>::max();
+		static constexpr std::size_t   Mask = _Capacity - 1;
+		static constexpr std::size_t   MaxTombstones = std::max<std::size_t>(_Capacity / 8, 1);
+
+		static std::size_t Hash(RE::TESFormID a_id)
+		{
+			// Fibonacci hashing spreads the sequential ids of references over the whole table
+			return static_cast<std::size_t>(static_cast<std::uint32_t>(a_id * 0x9E3779B1u) >> (32 - std::countr_zero(_Capacity)));
+		}
+
+		_Record_T* Probe(RE::TESFormID a_id)
+		{
+			for (std::size_t i = Hash(a_id), probes = 0; probes < _Capacity; i = (i + 1) & Mask, ++probes) {
+				auto key = m_keys[i].load(std::memory_order_acquire);
+				if (key == a_id) {
+					return &m_records[m_record_indices[i].load(std::memory_order_relaxed)];
+				} else if (key == EmptyKey) {
+					return nullptr;
+				}
+			}
+			return nullptr;
+		}
+
+		// m_version is odd while keys are written, Find() waits for it to be even and unchanged around its probe
+		void BeginWrite()
+		{
+			m_version.store(m_version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+
+		void EndWrite()
+		{
+			m_version.store(m_version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		// Reinserts the live keys without tombstones, records stay where they are. m_lock must be held
+		void Rehash()
+		{
+			std::vector<std::pair<RE::TESFormID, std::uint32_t>> live;
+			live.reserve(Size());
+
+			BeginWrite();
+			for (std::size_t i = 0; i < _Capacity; ++i) {
+				auto key = m_keys[i].load(std::memory_order_relaxed);
+				if (key != EmptyKey && key != ErasedKey) {
+					live.emplace_back(key, m_record_indices[i].load(std::memory_order_relaxed));
+				}
+				m_keys[i].store(EmptyKey, std::memory_order_relaxed);
+			}
+			for (auto [key, record] : live) {
+				auto i = Hash(key);
+				while (m_keys[i].load(std::memory_order_relaxed) != EmptyKey) {
+					i = (i + 1) & Mask;
+				}
+				m_record_indices[i].store(record, std::memory_order_relaxed);
+				m_keys[i].store(key, std::memory_order_relaxed);
+			}
+			EndWrite();
+
+			m_num_tombstones = 0;
+		}
+
+		// Queued behind the records freed before it. m_lock must be held
+		void FreeRecord(std::uint32_t a_record, std::chrono::steady_clock::time_point a_when)
+		{
+			m_free_records[(m_free_head + m_num_free) & Mask] = { a_record, a_when };
+			++m_num_free;
+		}
+
+		struct FreeRecord_T
+		{
+			std::uint32_t                         index{ 0 };
+			std::chrono::steady_clock::time_point freed;
+		};
+
+		alignas(64) std::array<std::atomic<RE::TESFormID>, _Capacity> m_keys;
+		std::array<std::atomic<std::uint32_t>, _Capacity>             m_record_indices;
+		std::array<_Record_T, _Capacity>                              m_records;
+		std::atomic<std::size_t>                                      m_size{ 0 };
+		std::atomic<std::uint32_t>                                    m_version{ 0 };
+
+		// Guarded by m_lock
+		mutex::NonReentrantSpinLock             m_lock;
+		std::array<FreeRecord_T, _Capacity>     m_free_records;  // Ring, oldest first
+		std::size_t                             m_free_head{ 0 };
+		std::size_t                             m_num_free{ 0 };
+		std::size_t                             m_num_tombstones{ 0 };
+	};
+}
@@ -1,6 +1,49 @@
 #include "MorphEvaluationRuleSet.h"
+#include "RulesetCache.h"
 
 bool daf::MorphEvaluationRuleSet::ParseScript(std::string a_filename, bool a_clearExisting, CollisionBehavior a_behavior)
+{
+	ParsedScript script;
+	if (!ReadScript(a_filename, script)) {
+		return false;
+	}
+	return ParseScript(script, a_clearExisting, a_behavior);
+}
+
+bool daf::MorphEvaluationRuleSet::ParseScript(const ParsedScript& a_script, bool a_clearExisting, CollisionBehavior a_behavior)
+{
+	if (a_clearExisting) {
+		Clear();
+	}
+
+	bool success = true;
+
+	// Parse aliases
+	for (auto& alias : a_script.aliases) {
+		if (!ParseAlias(alias.symbol, alias.editorID, alias.type, alias.default_to)) {
+			logger::error("When parsing Alias '{}': {}", alias.symbol, last_error);
+			success = false;
+		}
+	}
+
+	// Parse rules
+	for (auto& adder : a_script.adders) {
+		if (!ParseRule(adder.morph_name, adder.expression, false, a_behavior)) {
+			logger::error("When parsing Rule for '{}': {}", adder.morph_name, last_error);
+			success = false;
+		}
+	}
+	for (auto& setter : a_script.setters) {
+		if (!ParseRule(setter.morph_name, setter.expression, true, CollisionBehavior::kOverwrite)) {
+			logger::error("When parsing Rule for '{}': {}", setter.morph_name, last_error);
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+bool daf::MorphEvaluationRuleSet::ReadScript(const std::string& a_filename, ParsedScript& a_script)
 {
 	std::ifstream file(a_filename);
 	if (!file.is_open()) {
@@ -19,80 +62,65 @@ bool daf::MorphEvaluationRuleSet::ParseScript(std::string a_filename, bool a_cle
 	}
 	file.close();
 
-	if (a_clearExisting) {
-		Clear();
-	}
+	a_script = {};
 
-	bool success = true;
-
-	// Parse aliases
+	// Read aliases
 	if (j.contains("Aliases")) {
 		auto& aliases = j["Aliases"];
 		for (auto& [alias, alias_obj] : aliases.items()) {
-			std::string editorID;
-			Alias::Type alias_type = Alias::Type::kAny;
-			float       default_to = 0.f;
+			auto& entry = a_script.aliases.emplace_back();
+			entry.symbol = alias;
 			if (alias_obj.contains("EditorID")) {
-				editorID = alias_obj["EditorID"].get<std::string>();
+				entry.editorID = alias_obj["EditorID"].get<std::string>();
 			} else {
 				logger::error("When parsing Alias '{}': No EditorID found in definition.", alias);
 			}
 			if (alias_obj.contains("Type")) {
 				auto type_str = alias_obj["Type"].get<std::string>();
 				if (type_str == "actorValue") {
-					alias_type = Alias::Type::kActorValue;
+					entry.type = Alias::Type::kActorValue;
 				} else if (type_str == "wornKeyword") {
-					alias_type = Alias::Type::kWornKeyword;
+					entry.type = Alias::Type::kWornKeyword;
 				} else if (type_str == "visibleWornKeyword") {
-					alias_type = Alias::Type::kVisibleWornKeyword;
+					entry.type = Alias::Type::kVisibleWornKeyword;
 				} else if (type_str == "npcKeyword") {
-					alias_type = Alias::Type::kNPCKeyword;
+					entry.type = Alias::Type::kNPCKeyword;
 				} else if (type_str == "morph") {
-					alias_type = Alias::Type::kMorph;
+					entry.type = Alias::Type::kMorph;
 				} else if (type_str == "headpart") {
-					alias_type = Alias::Type::kHeadpart;
+					entry.type = Alias::Type::kHeadpart;
 				} else {
 					logger::warn("When parsing Alias '{}': Unknown Alias type: '{}', using automatic type.", alias, type_str);
 				}
 			}
 			if (alias_obj.contains("Default")) {
-				default_to = alias_obj["Default"].get<float>();
-			}
-			if (!ParseAlias(alias, editorID, alias_type, default_to)) {
-				logger::error("When parsing Alias '{}': {}", alias, last_error);
-				success = false;
+				entry.default_to = alias_obj["Default"].get<float>();
 			}
 		}
 	}
 
-	// Parse rules
+	// Read rules
 	if (j.contains("Rules")) {
 		auto& rules = j["Rules"];
 		if (rules.contains("Adders")) {
-			auto& adder = rules["Adders"];
-			for (auto& [morph_name, expr_str] : adder.items()) {
-				if (!ParseRule(morph_name, expr_str, false, a_behavior)) {
-					logger::error("When parsing Rule for '{}': {}", morph_name, last_error);
-					success = false;
-				}
+			for (auto& [morph_name, expr_str] : rules["Adders"].items()) {
+				a_script.adders.emplace_back(morph_name, expr_str.get<std::string>());
 			}
 		}
 		if (rules.contains("Setters")) {
-			auto& setter = rules["Setters"];
-			for (auto& [morph_name, expr_str] : setter.items()) {
-				if (!ParseRule(morph_name, expr_str, true, CollisionBehavior::kOverwrite)) {
-					logger::error("When parsing Rule for '{}': {}", morph_name, last_error);
-					success = false;
-				}
+			for (auto& [morph_name, expr_str] : rules["Setters"].items()) {
+				a_script.setters.emplace_back(morph_name, expr_str.get<std::string>());
 			}
 		}
 	}
 
-	return success;
+	return true;
 }
 
 bool daf::MorphEvaluationRuleSet::ParseAlias(std::string a_alias, std::string a_editorID, Alias::Type a_aliasType, float defaultTo)
 {
+	m_program.reset();
+
 	auto alias = _get_string_view(a_alias);
 	auto editorID = _get_string_view(a_editorID);
 
@@ -114,69 +142,36 @@ bool daf::MorphEvaluationRuleSet::ParseAlias(std::string a_alias, std::string a_
 	}
 
 	if (auto avi = ParseSymbolAsActorValue(editorID); (std::to_underlying(a_aliasType) & std::to_underlying(Alias::Type::kActorValue)) && avi) {
-		m_aliases[alias] = {
-			alias,
-			editorID,
-			Alias::Type::kActorValue,
-			[avi](RE::Actor* actor, RE::TESNPC* npc, ActorArmorVisableLayer) -> float {
-				return AcquireActorValue(actor, npc, avi);
-			}
-		};
+		m_aliases[alias] = { alias, editorID, Alias::Type::kActorValue };
+		m_aliases[alias].actor_value = avi;
 		m_loaded = true;
 		return true;
 	} else if (auto keyword = ParseSymbolAsKeyword(editorID); (std::to_underlying(a_aliasType) & std::to_underlying(Alias::Type::kWornKeyword)) && keyword) {
-		m_aliases[alias] = {
-			alias,
-			editorID,
-			Alias::Type::kWornKeyword,
-			[keyword](RE::Actor* actor, RE::TESNPC* npc, ActorArmorVisableLayer) -> float {
-				return AcquireWornKeywordValue(actor, npc, keyword, ActorArmorVisableLayer::kAny);
-			}
-		};
+		m_aliases[alias] = { alias, editorID, Alias::Type::kWornKeyword };
+		m_aliases[alias].keyword = keyword;
+		m_aliases[alias].worn_keyword_index = GetWornKeywordIndex(keyword);
 		m_loaded = true;
 		return true;
 	} else if (auto keyword = ParseSymbolAsKeyword(editorID); (std::to_underlying(a_aliasType) & std::to_underlying(Alias::Type::kVisibleWornKeyword)) && keyword) {
-		m_aliases[alias] = {
-			alias,
-			editorID,
-			Alias::Type::kWornKeyword,
-			[keyword](RE::Actor* actor, RE::TESNPC* npc, ActorArmorVisableLayer visLayer) -> float {
-				return AcquireWornKeywordValue(actor, npc, keyword, visLayer);
-			}
-		};
+		m_aliases[alias] = { alias, editorID, Alias::Type::kWornKeyword };
+		m_aliases[alias].keyword = keyword;
+		m_aliases[alias].worn_keyword_index = GetWornKeywordIndex(keyword);
+		m_aliases[alias].visible_layer_only = true;
 		m_loaded = true;
 		return true;
 	} else if (auto keyword = ParseSymbolAsKeyword(editorID); (std::to_underlying(a_aliasType) & std::to_underlying(Alias::Type::kNPCKeyword)) && keyword) {
-		m_aliases[alias] = {
-			alias,
-			editorID,
-			Alias::Type::kNPCKeyword,
-			[keyword](RE::Actor* actor, RE::TESNPC* npc, ActorArmorVisableLayer) -> float {
-				return AcquireNPCKeywordValue(actor, npc, keyword);
-			}
-		};
+		m_aliases[alias] = { alias, editorID, Alias::Type::kNPCKeyword };
+		m_aliases[alias].keyword = keyword;
 		m_loaded = true;
 		return true;
 	} else if (auto headpart = ParseSymbolAsHeadPart(editorID); (std::to_underlying(a_aliasType) & std::to_underlying(Alias::Type::kHeadpart)) && headpart) {
-		m_aliases[alias] = {
-			alias,
-			editorID,
-			Alias::Type::kHeadpart,
-			[headpart](RE::Actor* actor, RE::TESNPC* npc, ActorArmorVisableLayer) -> float {
-				return AcquireHeadPartValue(actor, npc, headpart);
-			}
-		};
+		m_aliases[alias] = { alias, editorID, Alias::Type::kHeadpart };
+		m_aliases[alias].headpart = headpart;
 		m_loaded = true;
 		return true;
 	} else if (std::to_underlying(a_aliasType) & std::to_underlying(Alias::Type::kMorph)) {
-		m_aliases[alias] = {
-			alias,
-			editorID,
-			Alias::Type::kMorph,
-			[editorID](RE::Actor* actor, RE::TESNPC* npc, ActorArmorVisableLayer) -> float {
-				return AcquireMorphValue(actor, npc, editorID);
-			}
-		};
+		m_aliases[alias] = { alias, editorID, Alias::Type::kMorph };
+		m_aliases[alias].morph = MorphNameRegistry::GetSingleton().Register(editorID);
 		m_loaded = true;
 		return true;
 	}
@@ -193,7 +188,10 @@ bool daf::MorphEvaluationRuleSet::ParseAlias(std::string a_alias, std::string a_
 
 bool daf::MorphEvaluationRuleSet::ParseRule(std::string a_targetMorphName, std::string a_exprStr, bool a_isSetter, CollisionBehavior a_behavior)
 {
-	auto target_morph_name = _get_string_view(a_targetMorphName);
+	m_program.reset();
+
+	auto             morph_id = MorphNameRegistry::GetSingleton().Register(a_targetMorphName);
+	std::string_view target_morph_name = MorphNameRegistry::GetSingleton().Get(morph_id).name;
 
 	Rule rule(this, a_isSetter);
 	rule.target_morph_name = target_morph_name;
@@ -216,6 +214,8 @@ bool daf::MorphEvaluationRuleSet::ParseRule(std::string a_targetMorphName, std::
 
 	if (!m_rules.contains(target_morph_name)) {  // If doesn't have any rules for the morph yet
 		m_rules[target_morph_name] = std::move(std::vector<Rule>{ rule });
+		m_morph_indices.try_emplace(target_morph_name, static_cast<std::uint32_t>(m_morphs.size()));
+		m_morphs.emplace_back(morph_id);
 	} else if (a_behavior == CollisionBehavior::kOverwrite) {  // If overwriting existing rules
 		m_rules[target_morph_name].clear();
 		m_rules[target_morph_name].emplace_back(rule);
@@ -247,26 +247,35 @@ void daf::MorphEvaluationRuleSet::Snapshot(RE::Actor* a_actor)
 	{
 		std::lock_guard<std::mutex> lock(m_snapshot_mutex);
 
-		auto visible_layer = ActorArmorVisableLayer::kAny;
-
-		if (utils::ShouldActorShowSpacesuit(a_actor)) {
-			visible_layer = ActorArmorVisableLayer::kSpaceSuit;
-		} else {
-			visible_layer = ActorArmorVisableLayer::kApparel;
-		}
+		auto visible_layer = GetVisibleLayer(a_actor);
+		GatherWornKeywords(a_actor, m_worn_keywords);
 
 		for (auto& [symbol, alias] : m_aliases) {
-			m_value_snapshot[symbol] = alias.acquisition_func(a_actor, npc, visible_layer);
+			m_value_snapshot[symbol] = AcquireAliasValue(alias, a_actor, npc, visible_layer, m_worn_keywords);
 		}
 	}
 }
 
-void daf::MorphEvaluationRuleSet::Evaluate(std::unordered_map<std::string_view, Result>& evaluated_values)
+void daf::MorphEvaluationRuleSet::Evaluate(ResultTable& evaluated_values)
 {
 	evaluated_values.clear();
 
 	std::lock_guard<std::mutex> lock(m_snapshot_mutex);
-	for (auto& [morph_name, rules] : m_rules) {
+
+	if (m_program) {
+		for (std::size_t i = 0; i < m_slot_values.size(); ++i) {
+			m_slot_values[i] = *m_slot_bindings[i];
+		}
+
+		m_program->Run(m_slot_values.data(), m_registers.data());
+		CollectResults(m_registers.data(), evaluated_values);
+		return;
+	}
+
+	auto& registry = MorphNameRegistry::GetSingleton();
+	for (auto morph_id : m_morphs) {
+		auto  morph_name = std::string_view(registry.Get(morph_id).name);
+		auto& rules = m_rules.find(morph_name)->second;
 		bool  is_setter = false;
 		float value = 0.f;
 		for (auto& rule : rules) {
@@ -287,10 +296,447 @@ void daf::MorphEvaluationRuleSet::Evaluate(std::unordered_map<std::string_view,
 			continue;
 		}
 
-		evaluated_values[morph_name] = { is_setter, value };
+		evaluated_values.emplace(morph_id, morph_name, is_setter, value);
 	}
 }
 
+bool daf::MorphEvaluationRuleSet::Snapshot(RE::Actor* a_actor, EvaluationContext& a_context) const
+{
+	if (!m_program) {
+		return false;
+	}
+
+	if (a_context.program_id != m_program_id) {
+		a_context.slots.resize(m_program->NumSlots());
+		a_context.registers.resize(m_program->NumRegisters());
+		a_context.program_id = m_program_id;
+		a_context.evaluated = false;
+	}
+
+	AcquireSlots(a_actor, a_context.slots.data(), 1, a_context.worn_keywords);
+
+	std::string_view bytes(reinterpret_cast<const char*>(a_context.slots.data()), a_context.slots.size() * sizeof(float));
+	a_context.slot_hash = std::hash<std::string_view>{}(bytes);
+	a_context.unchanged = a_context.evaluated &&
+	                      a_context.slot_hash == a_context.previous_hash &&
+	                      std::memcmp(a_context.slots.data(), a_context.previous_slots.data(), bytes.size()) == 0;
+	return true;
+}
+
+void daf::MorphEvaluationRuleSet::Evaluate(EvaluationContext& a_context, ResultTable& a_results) const
+{
+	a_results.clear();
+
+	if (!m_program || a_context.program_id != m_program_id) {
+		return;
+	}
+
+	MarkDirtyBlocks(a_context);
+	EvaluateDirtyBlocks(a_context, a_results);
+}
+
+void daf::MorphEvaluationRuleSet::MarkDirtyBlocks(EvaluationContext& a_context) const
+{
+	if (!a_context.evaluated) {
+		return;
+	}
+
+	// Morphs reading a changed symbol, then transitively the morphs reading those morphs
+	a_context.dirty_blocks.assign(m_program->GetMorphBlocks().size(), 0);
+	a_context.dirty_list.clear();
+
+	auto mark = [&a_context](std::uint32_t a_block) {
+		if (!a_context.dirty_blocks[a_block]) {
+			a_context.dirty_blocks[a_block] = 1;
+			a_context.dirty_list.emplace_back(a_block);
+		}
+	};
+
+	for (std::size_t slot = 0; slot < a_context.slots.size(); ++slot) {
+		if (std::bit_cast<std::uint32_t>(a_context.slots[slot]) != std::bit_cast<std::uint32_t>(a_context.previous_slots[slot])) {
+			for (auto block : m_slot_dependents[slot]) {
+				mark(block);
+			}
+		}
+	}
+	for (std::size_t i = 0; i < a_context.dirty_list.size(); ++i) {
+		for (auto block : m_block_dependents[a_context.dirty_list[i]]) {
+			mark(block);
+		}
+	}
+}
+
+void daf::MorphEvaluationRuleSet::EvaluateDirtyBlocks(EvaluationContext& a_context, ResultTable& a_results) const
+{
+	auto& blocks = m_program->GetMorphBlocks();
+	auto  num_rules = NumRules();
+
+	auto run = [this, &a_context, &blocks, num_rules]() {
+		if (!a_context.evaluated) {
+			m_program->Run(a_context.slots.data(), a_context.registers.data());
+			return num_rules;
+		}
+
+		if (a_context.dirty_list.empty()) {
+			return std::uint64_t(0);
+		}
+
+		// Subexpressions shared between morphs are only computed in the prologue
+		m_program->Run(a_context.slots.data(), a_context.registers.data(), 0, m_program->PrologueEnd());
+
+		std::uint64_t evaluated = 0;
+		for (auto index : a_context.dirty_list) {
+			auto& block = blocks[index];
+			m_program->Run(a_context.slots.data(), a_context.registers.data(), block.begin, block.end);
+			evaluated += block.num_terms;
+		}
+		return evaluated;
+	};
+
+	std::uint64_t evaluated = 0;
+	if (m_program->NumFallbacks() > 0) {
+		// exprtk expressions are bound to m_value_snapshot
+		std::lock_guard<std::mutex> lock(m_snapshot_mutex);
+		for (std::size_t slot = 0; slot < a_context.slots.size(); ++slot) {
+			*m_slot_bindings[slot] = a_context.slots[slot];
+		}
+		evaluated = run();
+	} else {
+		evaluated = run();
+	}
+
+	m_rules_evaluated.fetch_add(evaluated, std::memory_order_relaxed);
+	m_rules_skipped.fetch_add(num_rules - evaluated, std::memory_order_relaxed);
+
+	FinishEvaluation(a_context);
+	CollectResults(a_context.registers.data(), a_results);
+}
+
+void daf::MorphEvaluationRuleSet::FinishEvaluation(EvaluationContext& a_context)
+{
+	a_context.previous_slots = a_context.slots;
+	a_context.previous_hash = a_context.slot_hash;
+	a_context.evaluated = true;
+	a_context.unchanged = true;
+}
+
+std::uint64_t daf::MorphEvaluationRuleSet::NumRules() const
+{
+	std::uint64_t num_rules = 0;
+	for (auto& block : m_program->GetMorphBlocks()) {
+		num_rules += block.num_terms;
+	}
+	return num_rules;
+}
+
+void daf::MorphEvaluationRuleSet::CollectResults(const float* a_registers, ResultTable& a_results) const
+{
+	auto& blocks = m_program->GetMorphBlocks();
+	for (std::size_t i = 0; i < blocks.size(); ++i) {
+		auto& block = blocks[i];
+		float value = m_program->Accumulate(block, a_registers);
+		if (!block.is_setter && value == 0.f) {
+			continue;
+		}
+		a_results.emplace(m_morphs[i], block.morph_name, block.is_setter, value);
+	}
+}
+
+void daf::MorphEvaluationRuleSet::EvaluateBatch(std::span<EvaluationContext* const> a_contexts, std::span<ResultTable* const> a_results) const
+{
+	// Reused by every batch on this thread
+	thread_local std::vector<std::size_t> batched;
+	thread_local std::vector<float>       batch_slots;
+	thread_local std::vector<float>       batch_registers;
+	thread_local std::vector<float>       batch_values;
+
+	batched.clear();
+	for (std::size_t i = 0; i < a_contexts.size(); ++i) {
+		auto& context = *a_contexts[i];
+		a_results[i]->clear();
+		if (!m_program || context.program_id != m_program_id) {
+			continue;
+		}
+
+		// Recomputing a few morphs on its own is cheaper than running the whole program, even batched
+		MarkDirtyBlocks(context);
+		if (context.evaluated && context.dirty_list.size() * 2 <= m_program->GetMorphBlocks().size()) {
+			EvaluateDirtyBlocks(context, *a_results[i]);
+		} else {
+			batched.emplace_back(i);
+		}
+	}
+
+	if (batched.size() < 2) {
+		for (auto i : batched) {
+			EvaluateDirtyBlocks(*a_contexts[i], *a_results[i]);
+		}
+		return;
+	}
+
+	const std::size_t lanes = batched.size();
+	const auto        num_slots = m_program->NumSlots();
+	const auto        num_registers = m_program->NumRegisters();
+
+	batch_slots.resize(num_slots * lanes);
+	batch_registers.resize(num_registers * lanes);
+	batch_values.resize(lanes);
+
+	// Gather, one column per symbol
+	for (std::size_t lane = 0; lane < lanes; ++lane) {
+		auto& slots = a_contexts[batched[lane]]->slots;
+		for (std::uint32_t slot = 0; slot < num_slots; ++slot) {
+			batch_slots[slot * lanes + lane] = slots[slot];
+		}
+	}
+
+	auto run = [this, lanes, num_slots]() {
+		m_program->RunBatch(batch_slots.data(), batch_registers.data(), lanes, [this, lanes, num_slots](std::size_t lane) {
+			for (std::uint32_t slot = 0; slot < num_slots; ++slot) {
+				*m_slot_bindings[slot] = batch_slots[slot * lanes + lane];
+			}
+		});
+	};
+
+	if (m_program->NumFallbacks() > 0) {
+		// exprtk expressions are bound to m_value_snapshot
+		std::lock_guard<std::mutex> lock(m_snapshot_mutex);
+		run();
+	} else {
+		run();
+	}
+
+	m_rules_evaluated.fetch_add(NumRules() * lanes, std::memory_order_relaxed);
+
+	// Scattered back, so the next evaluation of each context can be incremental again
+	for (std::size_t lane = 0; lane < lanes; ++lane) {
+		auto& context = *a_contexts[batched[lane]];
+		for (std::uint32_t reg = 0; reg < num_registers; ++reg) {
+			context.registers[reg] = batch_registers[reg * lanes + lane];
+		}
+		FinishEvaluation(context);
+	}
+
+	auto& blocks = m_program->GetMorphBlocks();
+	for (std::size_t i = 0; i < blocks.size(); ++i) {
+		auto& block = blocks[i];
+		m_program->AccumulateBatch(block, batch_registers.data(), lanes, batch_values.data());
+		for (std::size_t lane = 0; lane < lanes; ++lane) {
+			float value = batch_values[lane];
+			if (!block.is_setter && value == 0.f) {
+				continue;
+			}
+			a_results[batched[lane]]->emplace(m_morphs[i], block.morph_name, block.is_setter, value);
+		}
+	}
+}
+
+bool daf::MorphEvaluationRuleSet::Compile()
+{
+	std::lock_guard<std::mutex> lock(m_snapshot_mutex);
+
+	auto program = BuildProgram({});
+	if (auto mismatched = VerifyProgram(*program); !mismatched.empty()) {
+		for (auto rule : mismatched) {
+			logger::warn("Compiled rule for '{}' doesn't match exprtk, keeping it on exprtk: '{}'", rule->target_morph_name, rule->expression);
+		}
+		program = BuildProgram(mismatched);
+	}
+
+	logger::info("Compiled ruleset: {} morphs, {} instructions ({} common subexpressions eliminated, {} shared), {} rules on exprtk fallback.",
+		program->GetMorphBlocks().size(), program->NumRegisters(), program->NumEliminated(), program->PrologueEnd(), program->NumFallbacks());
+	if (program->NumFoldedRules() > 0 || program->NumDeadRules() > 0) {
+		logger::info("Ruleset folding: {} rules folded to constants, {} dead rules eliminated, {} morphs resolved at load time.",
+			program->NumFoldedRules(), program->NumDeadRules(), program->NumStaticMorphs());
+	}
+
+	m_slot_values.resize(program->NumSlots());
+	m_registers.resize(program->NumRegisters());
+	m_program = std::move(program);
+	m_program_id = s_next_program_id.fetch_add(1, std::memory_order_relaxed);
+	m_rules_evaluated = 0;
+	m_rules_skipped = 0;
+	return true;
+}
+
+std::unique_ptr<daf::RuleProgram> daf::MorphEvaluationRuleSet::BuildProgram(const std::unordered_set<const Rule*>& a_forceFallback)
+{
+	auto to_lower = [](std::string_view a_str) {
+		std::string result(a_str);
+		std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		return result;
+	};
+
+	// Slots are grouped by alias type in AliasTable order
+	m_alias_table = {};
+	std::array<std::vector<Alias*>, 6> aliases_per_type;
+	for (auto& [symbol, alias] : m_aliases) {
+		switch (alias.type) {
+		case Alias::Type::kActorValue:
+			aliases_per_type[0].emplace_back(&alias);
+			m_alias_table.actor_values.emplace_back(alias.actor_value);
+			break;
+		case Alias::Type::kNPCKeyword:
+			aliases_per_type[1].emplace_back(&alias);
+			m_alias_table.npc_keywords.emplace_back(alias.keyword);
+			break;
+		case Alias::Type::kWornKeyword:
+			if (alias.visible_layer_only) {
+				aliases_per_type[3].emplace_back(&alias);
+				m_alias_table.visible_worn_keywords.emplace_back(alias.worn_keyword_index);
+			} else {
+				aliases_per_type[2].emplace_back(&alias);
+				m_alias_table.worn_keywords.emplace_back(alias.worn_keyword_index);
+			}
+			break;
+		case Alias::Type::kHeadpart:
+			aliases_per_type[4].emplace_back(&alias);
+			m_alias_table.headparts.emplace_back(alias.headpart);
+			break;
+		case Alias::Type::kMorph:
+			aliases_per_type[5].emplace_back(&alias);
+			m_alias_table.morphs.emplace_back(alias.morph);
+			break;
+		default:
+			break;
+		}
+	}
+
+	// exprtk symbols are case-insensitive, equivalent symbols share the slot of the alias they collapsed into
+	std::unordered_map<std::string, std::uint32_t> slots;
+	std::unordered_map<const Alias*, std::uint32_t> alias_slots;
+	m_slot_bindings.clear();
+	m_slot_aliases.clear();
+	for (auto& aliases : aliases_per_type) {
+		for (auto alias : aliases) {
+			auto slot = static_cast<std::uint32_t>(m_slot_bindings.size());
+			m_slot_bindings.emplace_back(&m_value_snapshot[alias->symbol]);
+			m_slot_aliases.emplace_back(alias);
+			alias_slots[alias] = slot;
+			slots[to_lower(alias->symbol)] = slot;
+			for (auto& equivalent_symbol : alias->equivalent_symbols) {
+				slots[to_lower(equivalent_symbol)] = slot;
+			}
+		}
+	}
+
+	m_slot_dependents.assign(m_slot_bindings.size(), {});
+
+	// Blocks are emitted in m_morphs order, one per morph
+	auto&                registry = MorphNameRegistry::GetSingleton();
+	RuleProgram::Builder builder(slots, static_cast<std::uint32_t>(m_slot_bindings.size()), m_symbol_table);
+	for (std::uint32_t block = 0; block < m_morphs.size(); ++block) {
+		auto  morph_name = std::string_view(registry.Get(m_morphs[block]).name);
+		auto& rules = m_rules.find(morph_name)->second;
+
+		std::unordered_set<std::uint32_t> dependencies;
+
+		builder.BeginMorph(morph_name);
+		for (auto& rule : rules) {
+			if (!rule.use_expr) {
+				continue;
+			}
+			builder.AddRule(rule.expression, rule.is_setter, &rule, a_forceFallback.contains(&rule));
+
+			// Equivalent symbols of collapsed aliases end up in internal_symbols
+			for (auto alias : rule.external_symbols) {
+				dependencies.insert(alias_slots[alias]);
+			}
+			for (auto& symbol : rule.internal_symbols) {
+				if (auto it = slots.find(to_lower(symbol)); it != slots.end()) {
+					dependencies.insert(it->second);
+				}
+			}
+		}
+		builder.EndMorph();
+
+		for (auto slot : dependencies) {
+			m_slot_dependents[slot].emplace_back(block);
+		}
+	}
+
+	m_block_dependents.assign(m_morphs.size(), {});
+	for (std::uint32_t slot = 0; slot < m_slot_aliases.size(); ++slot) {
+		auto alias = m_slot_aliases[slot];
+		if (alias->type != Alias::Type::kMorph) {
+			continue;
+		}
+		if (auto it = m_morph_indices.find(alias->editorID); it != m_morph_indices.end()) {
+			auto& dependents = m_block_dependents[it->second];
+			dependents.insert(dependents.end(), m_slot_dependents[slot].begin(), m_slot_dependents[slot].end());
+		}
+	}
+
+	return builder.Finish();
+}
+
+std::unordered_set<const daf::MorphEvaluationRuleSet::Rule*> daf::MorphEvaluationRuleSet::VerifyProgram(RuleProgram& a_program)
+{
+	std::unordered_set<const Rule*> mismatched;
+
+	const auto         num_slots = a_program.NumSlots();
+	std::vector<float> saved(num_slots);
+	std::vector<float> slots(num_slots);
+	std::vector<float> registers(a_program.NumRegisters());
+
+	for (std::uint32_t i = 0; i < num_slots; ++i) {
+		saved[i] = *m_slot_bindings[i];
+	}
+
+	// Fixed seed so a mismatch is reproducible between loads
+	std::minstd_rand                      rng(0x444146);
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+	std::uniform_real_distribution<float> wide(-2.f, 2.f);
+
+	constexpr int num_samples = 8;
+	for (int sample = 0; sample < num_samples; ++sample) {
+		for (std::uint32_t i = 0; i < num_slots; ++i) {
+			switch (sample) {
+			case 0:  // Alias defaults
+				slots[i] = saved[i];
+				break;
+			case 1:
+				slots[i] = 0.f;
+				break;
+			case 2:
+				slots[i] = 1.f;
+				break;
+			case 3:
+			case 4:  // Keyword-like
+				slots[i] = unit(rng) < 0.5f ? 0.f : 1.f;
+				break;
+			case 5:
+			case 6:
+				slots[i] = unit(rng);
+				break;
+			default:
+				slots[i] = wide(rng);
+				break;
+			}
+			*m_slot_bindings[i] = slots[i];
+		}
+
+		a_program.Run(slots.data(), registers.data());
+
+		for (auto& output : a_program.GetRuleOutputs()) {
+			if (!output.lowered || (!output.constant && output.reg == RuleProgram::NoRegister)) {
+				continue;
+			}
+			float expected = output.rule->Evaluate();
+			float actual = output.constant ? output.value : registers[output.reg];
+			if (expected != actual && !(std::isnan(expected) && std::isnan(actual))) {
+				mismatched.insert(static_cast<const Rule*>(output.rule));
+			}
+		}
+	}
+
+	for (std::uint32_t i = 0; i < num_slots; ++i) {
+		*m_slot_bindings[i] = saved[i];
+	}
+
+	return mismatched;
+}
+
 daf::MorphEvaluationRuleSet::Alias* daf::MorphEvaluationRuleSet::IsMorphLoopRule_Impl(const Rule& a_rule, const std::string_view& target_morph_name) const
 {
 	auto& external_symbols = a_rule.external_symbols;
@@ -322,59 +768,126 @@ float daf::MorphEvaluationRuleSet::AcquireNPCKeywordValue(RE::Actor* actor, RE::
 	return 0.f;
 }
 
-float daf::MorphEvaluationRuleSet::AcquireWornKeywordValue(RE::Actor* actor, RE::TESNPC* npc, RE::BGSKeyword* keyword, ActorArmorVisableLayer visible_layer)
+void daf::MorphEvaluationRuleSet::AcquireSlots(RE::Actor* a_actor, float* a_slots, std::size_t a_stride, WornKeywords& a_wornKeywords) const
+{
+	auto npc = a_actor->GetNPC();
+	auto out = a_slots;
+
+	for (auto actor_value : m_alias_table.actor_values) {
+		*out = a_actor->GetActorValue(*actor_value);
+		out += a_stride;
+	}
+
+	for (auto keyword : m_alias_table.npc_keywords) {
+		*out = npc->HasKeyword(keyword->formEditorID) ? 1.f : 0.f;
+		out += a_stride;
+	}
+
+	if (!m_alias_table.worn_keywords.empty() || !m_alias_table.visible_worn_keywords.empty()) {
+		GatherWornKeywords(a_actor, a_wornKeywords);
+
+		for (auto index : m_alias_table.worn_keywords) {
+			*out = WornKeywords::Test(a_wornKeywords.apparel, index) || WornKeywords::Test(a_wornKeywords.spacesuit, index) ? 1.f : 0.f;
+			out += a_stride;
+		}
+
+		if (!m_alias_table.visible_worn_keywords.empty()) {
+			auto& visible = GetVisibleLayer(a_actor) == ActorArmorVisableLayer::kSpaceSuit ? a_wornKeywords.spacesuit : a_wornKeywords.apparel;
+			for (auto index : m_alias_table.visible_worn_keywords) {
+				*out = WornKeywords::Test(visible, index) ? 1.f : 0.f;
+				out += a_stride;
+			}
+		}
+	}
+
+	if (!m_alias_table.headparts.empty()) {
+		auto  acc = npc->headParts.lock();
+		auto& headparts = *acc;
+		for (auto headpart : m_alias_table.headparts) {
+			float found = 0.f;
+			for (auto it = headparts.begin(); it != headparts.end() && *it != nullptr; ++it) {
+				if (*it == headpart) {
+					found = 1.f;
+					break;
+				}
+			}
+			*out = found;
+			out += a_stride;
+		}
+	}
+
+	for (auto morph : m_alias_table.morphs) {
+		*out = AcquireMorphValue(a_actor, npc, morph);
+		out += a_stride;
+	}
+}
+
+void daf::MorphEvaluationRuleSet::GatherWornKeywords(RE::Actor* a_actor, WornKeywords& a_wornKeywords) const
 {
-	float found = 0.f;
+	const std::size_t num_words = (m_worn_keyword_indices.size() + 63) / 64;
+	a_wornKeywords.apparel.assign(num_words, 0);
+	a_wornKeywords.spacesuit.assign(num_words, 0);
+	if (m_worn_keyword_indices.empty()) {
+		return;
+	}
 
-	actor->ForEachEquippedItem([visible_layer, keyword, &found](const RE::BGSInventoryItem& item) -> RE::BSContainer::ForEachResult {
+	std::vector<std::uint32_t> item_keywords;
+	a_actor->ForEachEquippedItem([this, &a_wornKeywords, &item_keywords](const RE::BGSInventoryItem& item) -> RE::BSContainer::ForEachResult {
 		auto armor = item.object->As<RE::TESObjectARMO>();
 		if (!armor) {
 			return RE::BSContainer::ForEachResult::kContinue;
 		}
 		auto instanceData = reinterpret_cast<RE::TESObjectARMOInstanceData*>(item.instanceData.get());
 
-		switch (visible_layer) {
-		case ActorArmorVisableLayer::kApparel:
-			if (utils::IsARMOSpacesuit(armor, instanceData)) {
-				return RE::BSContainer::ForEachResult::kContinue;
+		bool is_spacesuit = false;
+		item_keywords.clear();
+
+		auto visit = [this, &is_spacesuit, &item_keywords](const RE::BGSKeyword* a_keyword) {
+			if (utils::IsSpacesuitKeyword(a_keyword)) {
+				is_spacesuit = true;
 			}
-			break;
-		case ActorArmorVisableLayer::kSpaceSuit:
-			if (!utils::IsARMOSpacesuit(armor, instanceData)) {
-				return RE::BSContainer::ForEachResult::kContinue;
+			if (auto it = m_worn_keyword_indices.find(a_keyword); it != m_worn_keyword_indices.end()) {
+				item_keywords.emplace_back(it->second);
 			}
-			break;
+			return RE::BSContainer::ForEachResult::kContinue;
+		};
+
+		armor->ForEachKeyword(visit);
+		if (instanceData->keywords) {
+			instanceData->keywords->ForEachKeyword(visit);
 		}
 
-		if (utils::ARMOHasKeyword(armor, instanceData, keyword)) {
-			found = 1.f;
-			return RE::BSContainer::ForEachResult::kStop;
+		auto& bits = is_spacesuit ? a_wornKeywords.spacesuit : a_wornKeywords.apparel;
+		for (auto index : item_keywords) {
+			bits[index >> 6] |= std::uint64_t(1) << (index & 63);
 		}
 		return RE::BSContainer::ForEachResult::kContinue;
 	});
-
-	return found;
 }
 
-float daf::MorphEvaluationRuleSet::AcquireMorphValue(RE::Actor* actor, RE::TESNPC* npc, std::string_view morph_name)
+float daf::MorphEvaluationRuleSet::AcquireMorphValue(RE::Actor* actor, RE::TESNPC* npc, MorphID morph)
 {
-	if (morph_name == overweightMorphName) {
+	auto& entry = MorphNameRegistry::GetSingleton().Get(morph);
+	switch (entry.weight) {
+	case MorphNameRegistry::WeightMorph::kFat:
 		return npc->morphWeight.fat;
-	} else if (morph_name == strongMorphName) {
+	case MorphNameRegistry::WeightMorph::kMuscular:
 		return npc->morphWeight.muscular;
-	} else if (morph_name == thinMorphName) {
+	case MorphNameRegistry::WeightMorph::kThin:
 		return npc->morphWeight.thin;
-	} else {
-		if (!npc->shapeBlendData) {
-			return 0.f;
-		}
+	default:
+		{
+			if (!npc->shapeBlendData) {
+				return 0.f;
+			}
 
-		auto& morph_data = *npc->shapeBlendData;
-		auto  it = morph_data.find(morph_name);
-		if (it != morph_data.end()) {
-			return it->value;
+			auto& morph_data = *npc->shapeBlendData;
+			auto  it = morph_data.find(entry.fixed_name);
+			if (it != morph_data.end()) {
+				return it->value;
+			}
+			return 0.f;
 		}
-		return 0.f;
 	}
 }
 
@@ -394,13 +907,28 @@ float daf::MorphEvaluationRuleSet::AcquireHeadPartValue(RE::Actor* actor, RE::TE
 
 void daf::MorphRuleSetManager::LoadRulesets(std::string a_rootFolder)
 {
+	auto start_time = std::chrono::steady_clock::now();
+
 	std::filesystem::path root_path(a_rootFolder);
 	if (!std::filesystem::exists(root_path)) {
 		logger::error("Root folder does not exist: {}", a_rootFolder);
 		return;
 	}
 
-	ClearAllRulesets();
+	// The cache file is only read once, later loads keep using the in-memory entries
+	std::filesystem::path cache_path(a_rootFolder + ".cache");
+	if (CacheParsedRulesets && !m_script_cache_loaded) {
+		RulesetCache::GetSingleton().Load(cache_path);
+		m_script_cache_loaded = true;
+	}
+	const auto cache_hits = RulesetCache::GetSingleton().GetHits();
+	const auto cache_misses = RulesetCache::GetSingleton().GetMisses();
+
+	std::size_t num_rebuilt = 0;
+	std::size_t num_unchanged = 0;
+
+	std::unordered_set<RE::TESRace*> found_races;
+	std::vector<LoadJob>             jobs;
 
 	// For each subfolder in root folder, the folder name is the editorID of the race
 	for (auto& entry : std::filesystem::directory_iterator(root_path)) {
@@ -416,6 +944,7 @@ void daf::MorphRuleSetManager::LoadRulesets(std::string a_rootFolder)
 			logger::warn("Folder name '{}' doesn't resolve to any race editorID.", folder_name);
 			continue;
 		}
+		found_races.insert(race);
 
 		std::string           race_master_file;
 		std::filesystem::path male_entry;
@@ -441,33 +970,200 @@ void daf::MorphRuleSetManager::LoadRulesets(std::string a_rootFolder)
 			}
 		}
 
-		if (!race_master_file.empty()) {
-			bool is_new;
-			auto male_ruleset = GetOrCreate(race, RE::SEX::kMale, is_new);
-			auto female_ruleset = GetOrCreate(race, RE::SEX::kFemale, is_new);
-			logger::info("Loading race master for race '{}' for males: '{}'", folder_name, race_master_file);
-			male_ruleset->ParseScript(race_master_file, true);
-			logger::info("Loading race master for race '{}' for females: '{}'", folder_name, race_master_file);
-			female_ruleset->ParseScript(race_master_file, true);
-		} else {
-			logger::warn("No race master ruleset found for race '{}'", folder_name);
+		for (auto sex : { RE::SEX::kMale, RE::SEX::kFemale }) {
+			auto& sex_entry = sex == RE::SEX::kMale ? male_entry : female_entry;
+			auto  sex_id = static_cast<std::size_t>(sex);
+
+			// Forms can't change within a game session, so a ruleset built from the same files is still valid
+			auto fingerprint = FingerprintSources(race_master_file, sex_entry);
+			// A matching fingerprint also covers folders that built no ruleset, those stay without one
+			if (auto it = m_fingerprints.find(race); it != m_fingerprints.end() && it->second[sex_id] == fingerprint) {
+				++num_unchanged;
+				continue;
+			}
+
+			jobs.push_back({ race, sex, folder_name, race_master_file, sex_entry, fingerprint, jobs.size() });
 		}
+	}
 
-		if (!male_entry.empty()) {
-			LoadRaceSexRulesets(male_entry, race, RE::SEX::kMale);
+	// Jobs reading the exact same files, i.e. a race master without sex folders, share one ruleset instead of parsing it twice
+	std::unordered_map<std::uint64_t, std::size_t> fingerprint_jobs;
+	std::vector<LoadJob*>                          unique_jobs;
+	for (auto& job : jobs) {
+		if (job.race_master_file.empty() || !job.sex_folder.empty()) {
+			unique_jobs.emplace_back(&job);
+			continue;
+		}
+		auto [it, inserted] = fingerprint_jobs.try_emplace(job.fingerprint, job.source_job);
+		if (inserted) {
+			unique_jobs.emplace_back(&job);
 		} else {
-			logger::warn("No male folder found for race '{}'", folder_name);
+			job.source_job = it->second;
 		}
+	}
 
-		if (!female_entry.empty()) {
-			LoadRaceSexRulesets(female_entry, race, RE::SEX::kFemale);
+	// Race masters are read up front, once per race, so the builds of both sexes take the same ParsedScript even when the
+	// cache is cold. Each sex still resolves the master's EditorIDs and compiles its rules into its own ruleset:
+	// the exprtk expressions are bound to the ruleset's symbol table, and the RuleProgram lays its slots and registers
+	// over the merged master + sex folder rules, so neither can be reused across sexes without relinking it
+	std::unordered_map<std::string, const MorphEvaluationRuleSet::ParsedScript*>              race_master_scripts;
+	std::unordered_map<std::string, std::unique_ptr<MorphEvaluationRuleSet::ParsedScript>> uncached_scripts;
+	for (auto job : unique_jobs) {
+		if (!job->race_master_file.empty()) {
+			race_master_scripts.try_emplace(job->race_master_file, nullptr);
+			if (!CacheParsedRulesets) {
+				uncached_scripts.try_emplace(job->race_master_file, std::make_unique<MorphEvaluationRuleSet::ParsedScript>());
+			}
+		}
+	}
+	tbb::parallel_for_each(race_master_scripts.begin(), race_master_scripts.end(), [&uncached_scripts](auto& a_entry) {
+		if (CacheParsedRulesets) {
+			a_entry.second = RulesetCache::GetSingleton().Get(a_entry.first);
+		} else if (auto& script = uncached_scripts.at(a_entry.first); MorphEvaluationRuleSet::ReadScript(a_entry.first, *script)) {
+			a_entry.second = script.get();
+		}
+	});
+	for (auto job : unique_jobs) {
+		if (!job->race_master_file.empty()) {
+			job->race_master_script = race_master_scripts.at(job->race_master_file);
+		}
+	}
+
+	// Rulesets are independent, build them all in parallel and only install them once they're complete
+	tbb::parallel_for_each(unique_jobs.begin(), unique_jobs.end(), [this](LoadJob* a_job) {
+		BuildRuleset(*a_job);
+	});
+
+	for (auto& job : jobs) {
+		if (job.source_job != static_cast<std::size_t>(&job - jobs.data())) {
+			auto& source = jobs[job.source_job];
+			logger::info("{} ruleset for race '{}' shares the {} ruleset.", utils::GetSexString(job.sex), job.folder_name, utils::GetSexString(source.sex));
+			job.ruleset = source.ruleset;
+			job.failed = source.failed;
+		} else {
+			logger::info("Built {} ruleset for race '{}' in {} ms.", utils::GetSexString(job.sex), job.folder_name, job.elapsed_ms);
+		}
+	}
+	// Builds that couldn't read or parse all of their files aren't fingerprinted, so the next load retries them
+	std::size_t num_failed = 0;
+	for (auto& job : jobs) {
+		auto& fingerprint = m_fingerprints[job.race][static_cast<std::size_t>(job.sex)];
+		if (job.failed) {
+			logger::warn("{} ruleset for race '{}' had errors, it will be rebuilt on the next load.", utils::GetSexString(job.sex), job.folder_name);
+			fingerprint.reset();
+			++num_failed;
 		} else {
-			logger::warn("No female folder found for race '{}'", folder_name);
+			fingerprint = job.fingerprint;
 		}
+		Set(job.race, job.sex, std::move(job.ruleset));
+	}
+	num_rebuilt = jobs.size();
+
+	// Drop rulesets of race folders that were removed
+	std::vector<RE::TESRace*> removed_races;
+	for (auto& [race, rulesets] : m_per_race_sex_ruleset) {
+		if (!found_races.contains(race)) {
+			removed_races.emplace_back(race);
+		}
+	}
+	for (auto race : removed_races) {
+		m_per_race_sex_ruleset.erase(race);
+		m_fingerprints.erase(race);
 	}
+
+	if (CacheParsedRulesets) {
+		auto& cache = RulesetCache::GetSingleton();
+		logger::info("Ruleset cache: {} files unchanged, {} files reparsed.", cache.GetHits() - cache_hits, cache.GetMisses() - cache_misses);
+		cache.Save(cache_path);
+	}
+
+	auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count();
+	logger::info("Rulesets loaded in {} ms: {} rebuilt ({} with errors), {} unchanged, {} removed.", elapsed_ms, num_rebuilt, num_failed, num_unchanged, removed_races.size());
+}
+
+void daf::MorphRuleSetManager::BuildRuleset(LoadJob& a_job)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	auto ruleset = std::make_shared<MorphEvaluationRuleSet>();
+	bool has_rules = false;
+
+	if (!a_job.race_master_file.empty()) {
+		logger::info("Loading race master for race '{}' for {}s: '{}'", a_job.folder_name, utils::GetSexString(a_job.sex), a_job.race_master_file);
+		if (!a_job.race_master_script || !ruleset->ParseScript(*a_job.race_master_script, true)) {
+			a_job.failed = true;
+		}
+		has_rules = true;
+	} else {
+		logger::warn("No race master ruleset found for race '{}'", a_job.folder_name);
+	}
+
+	if (!a_job.sex_folder.empty()) {
+		bool parsed = true;
+		has_rules |= ParseSexFolder(ruleset.get(), a_job.sex_folder, !has_rules, &parsed);
+		a_job.failed |= !parsed;
+	} else {
+		logger::warn("No {} folder found for race '{}'", utils::GetSexString(a_job.sex), a_job.folder_name);
+	}
+
+	if (has_rules) {
+		if (CompileRulesets) {
+			logger::info("Compiling {} ruleset for race '{}'", utils::GetSexString(a_job.sex), a_job.folder_name);
+			ruleset->Compile();
+		}
+		a_job.ruleset = std::move(ruleset);
+	}
+
+	a_job.elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+std::uint64_t daf::MorphRuleSetManager::FingerprintSources(const std::string& a_raceMasterFile, const std::filesystem::path& a_sexFolder)
+{
+	std::vector<std::filesystem::path> files;
+	if (!a_raceMasterFile.empty()) {
+		files.emplace_back(a_raceMasterFile);
+	}
+
+	std::error_code ec;
+	if (!a_sexFolder.empty()) {
+		for (auto& ruleset_entry : std::filesystem::directory_iterator(a_sexFolder, ec)) {
+			if (ruleset_entry.is_regular_file() && ruleset_entry.path().extension() == ".json") {
+				files.emplace_back(ruleset_entry.path());
+			}
+		}
+		std::sort(files.begin() + (a_raceMasterFile.empty() ? 0 : 1), files.end());
+	}
+
+	std::string key;
+	for (auto& file : files) {
+		auto size = std::filesystem::file_size(file, ec);
+		auto write_time = std::filesystem::last_write_time(file, ec).time_since_epoch().count();
+		key += std::format("{}|{}|{};", file.string(), size, write_time);
+	}
+	return std::hash<std::string>{}(key);
+}
+
+bool daf::MorphRuleSetManager::ParseScript(MorphEvaluationRuleSet* a_ruleset, const std::string& a_filename, bool a_clearExisting, MorphEvaluationRuleSet::CollisionBehavior a_behavior)
+{
+	if (!CacheParsedRulesets) {
+		return a_ruleset->ParseScript(a_filename, a_clearExisting, a_behavior);
+	}
+
+	auto script = RulesetCache::GetSingleton().Get(a_filename);
+	if (!script) {
+		return false;
+	}
+	return a_ruleset->ParseScript(*script, a_clearExisting, a_behavior);
 }
 
 bool daf::MorphRuleSetManager::LoadRaceSexRulesets(std::filesystem::path a_sexFolder, RE::TESRace* a_race, RE::SEX a_sex)
+{
+	bool is_new{ false };
+	auto ruleset = GetOrCreate(a_race, a_sex, is_new);
+	return ParseSexFolder(ruleset, a_sexFolder, is_new);
+}
+
+bool daf::MorphRuleSetManager::ParseSexFolder(MorphEvaluationRuleSet* a_ruleset, const std::filesystem::path& a_sexFolder, bool a_clearExisting, bool* a_parsed)
 {
 	std::vector<std::string> ruleset_files;
 	std::string              master_file;
@@ -490,14 +1186,16 @@ bool daf::MorphRuleSetManager::LoadRaceSexRulesets(std::filesystem::path a_sexFo
 		return false;
 	}
 
-	bool is_new{ false };
 	logger::info("Loading master ruleset in: '{}'", master_file);
-	GetOrCreate(a_race, a_sex, is_new)->ParseScript(master_file, is_new);
+	bool parsed = ParseScript(a_ruleset, master_file, a_clearExisting);
 
 	for (auto& ruleset_file : ruleset_files) {
-		bool is_new{ false };
 		logger::info("Loading ruleset in: '{}'", ruleset_file);
-		GetOrCreate(a_race, a_sex, is_new)->ParseScript(ruleset_file, false, MorphEvaluationRuleSet::CollisionBehavior::kAppend);
+		parsed &= ParseScript(a_ruleset, ruleset_file, false, MorphEvaluationRuleSet::CollisionBehavior::kAppend);
+	}
+
+	if (a_parsed) {
+		*a_parsed = parsed;
 	}
 
 	return true;
@@ -520,7 +1218,7 @@ daf::MorphEvaluationRuleSet* daf::MorphRuleSetManager::GetOrCreate(RE::TESRace*
 	} else {
 		m_per_race_sex_ruleset.insert(acc,
 			std::make_pair(a_race,
-				std::array<std::unique_ptr<MorphEvaluationRuleSet>, 2>{
+				std::array<std::shared_ptr<MorphEvaluationRuleSet>, 2>{
 					nullptr,
 					nullptr }));
 		acc->second[sex_id].reset(new MorphEvaluationRuleSet());
@@ -5,9 +5,14 @@
 #include "MutexUtils.h"
 
 #include "DynamicMorphSession.h"
+#include "MorphNameRegistry.h"
+#include "RuleProgram.h"
 
 namespace daf
 {
+	// Lower every loaded ruleset into a RuleProgram after loading, exprtk is only kept for unsupported rules
+	inline constexpr bool CompileRulesets = true;
+
 	class MorphEvaluationRuleSet
 	{
 	public:
@@ -27,7 +32,19 @@ namespace daf
 			kAny = kApparel | kSpaceSuit
 		};
 
-		using AcquisitionFunction = std::function<float(RE::Actor*, RE::TESNPC*, ActorArmorVisableLayer)>;
+		inline static constexpr std::uint32_t NoKeywordIndex = std::numeric_limits<std::uint32_t>::max();
+
+		// Keywords of an actor's equipped armor gathered in a single pass, bit i is the keyword with dense index i
+		struct WornKeywords
+		{
+			std::vector<std::uint64_t> apparel;
+			std::vector<std::uint64_t> spacesuit;
+
+			static bool Test(const std::vector<std::uint64_t>& a_bits, std::uint32_t a_index)
+			{
+				return (a_bits[a_index >> 6] >> (a_index & 63)) & 1;
+			}
+		};
 
 		class Alias
 		{
@@ -47,8 +64,8 @@ namespace daf
 			};
 
 			Alias() = default;
-			Alias(std::string_view a_symbol, std::string_view a_editorID, Type a_type, AcquisitionFunction a_acquisition_func) :
-				symbol(a_symbol), editorID(a_editorID), type(a_type), acquisition_func(a_acquisition_func) {}
+			Alias(std::string_view a_symbol, std::string_view a_editorID, Type a_type) :
+				symbol(a_symbol), editorID(a_editorID), type(a_type) {}
 
 			inline bool is_same_as(const Alias& a_rhs) const
 			{
@@ -60,12 +77,21 @@ namespace daf
 				return (std::to_underlying(type) & std::to_underlying(a_type)) && editorID == a_editorID;
 			}
 
-			Symbol             symbol;
-			std::string_view   editorID;
-			Type               type{ Type::kNone };
-			AcquisitionFunction acquisition_func;
+			Symbol           symbol;
+			std::string_view editorID;
+			Type             type{ Type::kNone };
 
 			std::vector<Symbol> equivalent_symbols;
+
+			// Form read by the alias, depending on type. kMorph aliases read the morph named editorID
+			RE::ActorValueInfo* actor_value{ nullptr };
+			RE::BGSKeyword*     keyword{ nullptr };
+			RE::BGSHeadPart*    headpart{ nullptr };
+			MorphID             morph{ NoMorphID };
+
+			// kWornKeyword aliases are read from WornKeywords
+			std::uint32_t worn_keyword_index{ NoKeywordIndex };
+			bool          visible_layer_only{ false };
 		};
 
 		class Rule : public utils::Evaluatable<float>
@@ -75,6 +101,7 @@ namespace daf
 
 			std::string_view target_morph_name;
 			bool             is_setter{ false };
+			std::string      expression;
 
 			std::vector<Alias*>      external_symbols;
 			std::vector<std::string> internal_symbols;
@@ -86,6 +113,7 @@ namespace daf
 			bool Parse(const std::string& expr_str, _SymbolTable_T& symbol_table) override
 			{
 				this->symbol_table = &symbol_table;
+				expression = expr_str;
 				expr.register_symbol_table(symbol_table);
 				_Parser_T parser(_Parser_T::settings_t::e_collect_vars);
 				if (!parser.compile(expr_str, expr)) {
@@ -108,13 +136,106 @@ namespace daf
 			}
 		};
 
+		// Plain contents of one ruleset JSON file, before any EditorID is resolved or expression compiled
+		struct ParsedScript
+		{
+			struct AliasEntry
+			{
+				std::string symbol;
+				std::string editorID;
+				Alias::Type type{ Alias::Type::kAny };
+				float       default_to{ 0.f };
+			};
+
+			struct RuleEntry
+			{
+				std::string morph_name;
+				std::string expression;
+			};
+
+			std::vector<AliasEntry> aliases;
+			std::vector<RuleEntry>  adders;
+			std::vector<RuleEntry>  setters;
+		};
+
 		struct Result
 		{
-			bool  is_setter{ false };
-			float value{ 0.f };
+			MorphID          morph_id{ NoMorphID };
+			std::string_view morph_name;  // Owned by MorphNameRegistry
+			bool             is_setter{ false };
+			float            value{ 0.f };
+		};
+
+		// Evaluated morphs in the ruleset's morph order, morphs whose Adders sum to 0 are left out.
+		// A table reused across evaluations keeps its capacity, so refilling it doesn't allocate.
+		class ResultTable
+		{
+		public:
+			void clear() { m_results.clear(); }
+
+			void reserve(std::size_t a_size) { m_results.reserve(a_size); }
+
+			void emplace(MorphID a_morphID, std::string_view a_morphName, bool a_isSetter, float a_value)
+			{
+				m_results.emplace_back(a_morphID, a_morphName, a_isSetter, a_value);
+			}
+
+			std::size_t size() const { return m_results.size(); }
+
+			bool empty() const { return m_results.empty(); }
+
+			auto begin() const { return m_results.begin(); }
+
+			auto end() const { return m_results.end(); }
+
+		private:
+			std::vector<Result> m_results;
+		};
+
+		// Symbol values and registers of one evaluation of a compiled ruleset. The ruleset itself stays immutable
+		// after Compile(), so any number of threads can evaluate it at once, each with its own context.
+		// Kept per actor, a context also remembers the previous snapshot so only morphs whose inputs changed are recomputed.
+		class EvaluationContext
+		{
+		public:
+			std::vector<float> slots;
+			std::vector<float> registers;
+			WornKeywords       worn_keywords;
+
+			// True if the last Snapshot() is bit-identical to the snapshot of the last Evaluate(), evaluating it again changes nothing
+			bool IsUnchanged() const
+			{
+				return unchanged;
+			}
+
+			// Forces the next Evaluate() to recompute everything, for when the actor's morphs may have been reset externally
+			void Invalidate()
+			{
+				evaluated = false;
+				unchanged = false;
+			}
+
+		private:
+			friend class MorphEvaluationRuleSet;
+
+			// Program the buffers were sized for, contexts outlive recompiles and reloads
+			std::uint64_t program_id{ 0 };
+
+			// registers hold the results of previous_slots
+			bool                       evaluated{ false };
+			bool                       unchanged{ false };
+			std::size_t                slot_hash{ 0 };
+			std::size_t                previous_hash{ 0 };
+			std::vector<float>         previous_slots;
+			std::vector<std::uint8_t>  dirty_blocks;
+			std::vector<std::uint32_t> dirty_list;
 		};
 
-		using ResultTable = std::unordered_map<std::string_view, Result>;
+		struct EvaluationStats
+		{
+			std::uint64_t rules_evaluated{ 0 };
+			std::uint64_t rules_skipped{ 0 };
+		};
 
 		MorphEvaluationRuleSet()
 		{
@@ -132,6 +253,10 @@ namespace daf
 			m_rules.clear();
 			m_symbol_table.clear();
 			m_value_snapshot.clear();
+			m_worn_keyword_indices.clear();
+			m_morphs.clear();
+			m_morph_indices.clear();
+			m_program.reset();
 			m_loaded = false;
 		}
 		
@@ -155,6 +280,11 @@ namespace daf
 		*/
 		bool ParseScript(std::string a_filename, bool a_clearExisting, CollisionBehavior a_behavior = CollisionBehavior::kOverwrite);
 
+		bool ParseScript(const ParsedScript& a_script, bool a_clearExisting, CollisionBehavior a_behavior = CollisionBehavior::kOverwrite);
+
+		// Reads a ruleset JSON file without touching any ruleset, the result can be cached and parsed into many rulesets
+		static bool ReadScript(const std::string& a_filename, ParsedScript& a_script);
+
 		bool ParseAlias(std::string a_alias, std::string a_editorID, Alias::Type a_aliasType = Alias::Type::kAny, float defaultTo = 0.f);
 
 		bool ParseRule(std::string a_targetMorphName, std::string a_exprStr, bool a_isSetter, CollisionBehavior a_behavior = CollisionBehavior::kOverwrite);
@@ -167,6 +297,10 @@ namespace daf
 
 		void Snapshot(RE::Actor* a_actor);
 
+		// Lock-free snapshot into a caller-owned context, returns false if the ruleset isn't compiled.
+		// Hashes the snapshot so an unchanged actor can be detected with EvaluationContext::IsUnchanged().
+		bool Snapshot(RE::Actor* a_actor, EvaluationContext& a_context) const;
+
 		template <typename _arithmetic_t>
 		requires std::is_arithmetic_v<_arithmetic_t>
 		bool SetSymbolSnapshot(Symbol a_symbol, _arithmetic_t a_value)
@@ -191,31 +325,101 @@ namespace daf
 			return m_value_snapshot.contains(a_symbol);
 		}
 
-		void Evaluate(std::unordered_map<std::string_view, Result>& evaluated_values);
+		void Evaluate(ResultTable& evaluated_values);
+
+		// Evaluates the compiled program on a context filled by Snapshot(a_actor, a_context). Touches no shared state
+		// unless the program has exprtk fallbacks, those read the shared snapshot and are serialized on m_snapshot_mutex.
+		// If the context was evaluated before, only the morphs depending on changed symbols are recomputed,
+		// a_results always receives every morph.
+		void Evaluate(EvaluationContext& a_context, ResultTable& a_results) const;
+
+		// Rules recomputed and skipped by incremental Evaluate() calls since the ruleset was compiled
+		EvaluationStats GetEvaluationStats() const
+		{
+			return { m_rules_evaluated.load(std::memory_order_relaxed), m_rules_skipped.load(std::memory_order_relaxed) };
+		}
+
+		// Evaluate() of many contexts at once, a_results[i] receives the results of a_contexts[i]. Contexts whose changes only
+		// touch a few morphs are evaluated incrementally on their own, the others are gathered column-per-symbol so the compiled
+		// program runs each instruction across all of them at once. Same locking as Evaluate().
+		void EvaluateBatch(std::span<EvaluationContext* const> a_contexts, std::span<ResultTable* const> a_results) const;
+
+		// Lowers every Rule into one RuleProgram and verifies it against exprtk, rules that don't match stay on exprtk.
+		// Must be called again after parsing more scripts, any Parse* call drops the compiled program.
+		bool Compile();
+
+		bool IsCompiled() const
+		{
+			return m_program != nullptr;
+		}
 
 		bool IsLoaded() const
 		{
 			return m_loaded;
 		}
 
+		// Registry ids of the morphs targeted by rules, in the order their first rule was parsed.
+		// The compiled program has one block per morph, in the same order.
+		std::span<const MorphID> GetMorphs() const
+		{
+			return m_morphs;
+		}
+
 		mutex::NonReentrantSpinLock m_ruleset_spinlock;
 
 	private:
 		// Per actor
-		std::mutex                        m_snapshot_mutex;
+		mutable std::mutex                m_snapshot_mutex;
 		std::unordered_map<Symbol, float> m_value_snapshot;
 
 		// Shared
 		std::unordered_map<std::string_view, std::vector<Rule>> m_rules;
 		std::unordered_map<Symbol, Alias>          m_aliases;
 
+		std::vector<MorphID>                                m_morphs;
+		std::unordered_map<std::string_view, std::uint32_t> m_morph_indices;  // Index in m_morphs of each morph name
+
 		std::string last_error;
 		SymbolTable m_symbol_table;
 
 		bool m_loaded{ false };
 
+		// Compiled program, slot i reads the exprtk-bound snapshot value *m_slot_bindings[i]
+		std::unique_ptr<RuleProgram> m_program;
+		std::uint64_t                m_program_id{ 0 };
+		std::vector<float*>          m_slot_bindings;
+		std::vector<Alias*>          m_slot_aliases;
+
+		// Slots of the compiled program grouped by alias type, laid out in member order so each type is acquired by one linear loop
+		struct AliasTable
+		{
+			std::vector<RE::ActorValueInfo*> actor_values;
+			std::vector<RE::BGSKeyword*>     npc_keywords;
+			std::vector<std::uint32_t>       worn_keywords;  // WornKeywords indices
+			std::vector<std::uint32_t>       visible_worn_keywords;
+			std::vector<RE::BGSHeadPart*>    headparts;
+			std::vector<MorphID>             morphs;
+		};
+
+		AliasTable m_alias_table;
+		std::vector<float>           m_slot_values;
+		std::vector<float>           m_registers;
+
+		// Reverse dependency index, morph blocks reading each slot, and morph blocks reading each block's morph through a kMorph alias
+		std::vector<std::vector<std::uint32_t>> m_slot_dependents;
+		std::vector<std::vector<std::uint32_t>> m_block_dependents;
+
+		mutable std::atomic<std::uint64_t> m_rules_evaluated{ 0 };
+		mutable std::atomic<std::uint64_t> m_rules_skipped{ 0 };
+
 		std::unordered_set<std::string> m_string_pool;
 
+		// Dense index of every keyword read by a worn keyword alias
+		std::unordered_map<const RE::BGSKeyword*, std::uint32_t> m_worn_keyword_indices;
+		WornKeywords                                             m_worn_keywords;
+
+		static inline std::atomic<std::uint64_t> s_next_program_id{ 1 };
+
 		std::string_view _get_string_view(const std::string& str)
 		{
 			auto it = m_string_pool.find(str);
@@ -227,6 +431,70 @@ namespace daf
 
 		Alias* IsMorphLoopRule_Impl(const Rule& a_rule, const std::string_view& target_morph_name) const;
 
+		std::unique_ptr<RuleProgram> BuildProgram(const std::unordered_set<const Rule*>& a_forceFallback);
+
+		// Evaluates both paths on sampled symbol values, returns the Rules whose lowered result differs from exprtk
+		std::unordered_set<const Rule*> VerifyProgram(RuleProgram& a_program);
+
+		void CollectResults(const float* a_registers, ResultTable& a_results) const;
+
+		// Lists the morph blocks of a previously evaluated context whose inputs changed since its last evaluation
+		void MarkDirtyBlocks(EvaluationContext& a_context) const;
+
+		// Runs the whole program on a context never evaluated, only its dirty blocks otherwise, and collects every morph
+		void EvaluateDirtyBlocks(EvaluationContext& a_context, ResultTable& a_results) const;
+
+		// The context's registers now hold the results of its slots
+		static void FinishEvaluation(EvaluationContext& a_context);
+
+		std::uint64_t NumRules() const;
+
+		std::uint32_t GetWornKeywordIndex(const RE::BGSKeyword* a_keyword)
+		{
+			auto [it, inserted] = m_worn_keyword_indices.try_emplace(a_keyword, static_cast<std::uint32_t>(m_worn_keyword_indices.size()));
+			return it->second;
+		}
+
+		// Walks the actor's equipment once and sets the bit of every indexed keyword found, per layer
+		void GatherWornKeywords(RE::Actor* a_actor, WornKeywords& a_wornKeywords) const;
+
+		static float AcquireWornKeywordValue(std::uint32_t a_index, bool a_visibleLayerOnly, ActorArmorVisableLayer a_visibleLayer, const WornKeywords& a_wornKeywords)
+		{
+			bool found;
+			if (a_visibleLayerOnly) {
+				found = WornKeywords::Test(a_visibleLayer == ActorArmorVisableLayer::kSpaceSuit ? a_wornKeywords.spacesuit : a_wornKeywords.apparel, a_index);
+			} else {
+				found = WornKeywords::Test(a_wornKeywords.apparel, a_index) || WornKeywords::Test(a_wornKeywords.spacesuit, a_index);
+			}
+			return found ? 1.f : 0.f;
+		}
+
+		static float AcquireAliasValue(const Alias& a_alias, RE::Actor* a_actor, RE::TESNPC* a_npc, ActorArmorVisableLayer a_visibleLayer, const WornKeywords& a_wornKeywords)
+		{
+			switch (a_alias.type) {
+			case Alias::Type::kActorValue:
+				return AcquireActorValue(a_actor, a_npc, a_alias.actor_value);
+			case Alias::Type::kWornKeyword:
+				return AcquireWornKeywordValue(a_alias.worn_keyword_index, a_alias.visible_layer_only, a_visibleLayer, a_wornKeywords);
+			case Alias::Type::kNPCKeyword:
+				return AcquireNPCKeywordValue(a_actor, a_npc, a_alias.keyword);
+			case Alias::Type::kHeadpart:
+				return AcquireHeadPartValue(a_actor, a_npc, a_alias.headpart);
+			case Alias::Type::kMorph:
+				return AcquireMorphValue(a_actor, a_npc, a_alias.morph);
+			default:
+				return 0.f;
+			}
+		}
+
+		// Fills the compiled program's slots from m_alias_table, slot s is written to a_slots[s * a_stride]
+		void AcquireSlots(RE::Actor* a_actor, float* a_slots, std::size_t a_stride, WornKeywords& a_wornKeywords) const;
+
+		static ActorArmorVisableLayer GetVisibleLayer(RE::Actor* a_actor)
+		{
+			return utils::ShouldActorShowSpacesuit(a_actor) ? ActorArmorVisableLayer::kSpaceSuit : ActorArmorVisableLayer::kApparel;
+		}
+
 		static inline bool IsSymbolConstant(std::string_view symbol)
 		{
 			return	symbol == "pi"sv || 
@@ -251,14 +519,12 @@ namespace daf
 
 		static float AcquireNPCKeywordValue(RE::Actor* actor, RE::TESNPC* npc, RE::BGSKeyword* keyword);
 
-		static float AcquireWornKeywordValue(RE::Actor* actor, RE::TESNPC* npc, RE::BGSKeyword* keyword, ActorArmorVisableLayer visible_layer);
-
 		static inline float AcquireActorValue(RE::Actor* actor, RE::TESNPC* npc, RE::ActorValueInfo* actor_value_info)
 		{
 			return actor->GetActorValue(*actor_value_info);
 		}
 
-		static float AcquireMorphValue(RE::Actor* actor, RE::TESNPC* npc, std::string_view morph_name);
+		static float AcquireMorphValue(RE::Actor* actor, RE::TESNPC* npc, MorphID morph);
 
 		static float AcquireHeadPartValue(RE::Actor* actor, RE::TESNPC* npc, RE::BGSHeadPart* headpart);
 
@@ -288,32 +554,58 @@ namespace daf
 	{
 		friend class utils::SingletonBase<MorphRuleSetManager>;
 	public:
-		using RuleSetCollection_T = tbb::concurrent_hash_map<RE::TESRace*, std::array<std::unique_ptr<MorphEvaluationRuleSet>, 2>>;
+		// Both sexes point to the same ruleset when they are built from the same files
+		using RuleSetCollection_T = tbb::concurrent_hash_map<RE::TESRace*, std::array<std::shared_ptr<MorphEvaluationRuleSet>, 2>>;
 
 		RuleSetCollection_T m_per_race_sex_ruleset;
  
 		MorphEvaluationRuleSet* Get(RE::TESRace* a_race, const RE::SEX a_sex)
 		{
-			RuleSetCollection_T::accessor acc;
+			// Read lock only, actors of the same race are looked up from many threads at once
+			RuleSetCollection_T::const_accessor acc;
 			if (m_per_race_sex_ruleset.find(acc, a_race)) {
 				return acc->second[static_cast<std::size_t>(a_sex)].get();
 			}
 			return nullptr;
 		}
 
-		MorphEvaluationRuleSet* GetForActor(RE::Actor* a_actor)
+		// Keeps the ruleset alive while it's evaluated, a reload may replace it meanwhile
+		std::shared_ptr<MorphEvaluationRuleSet> GetSharedForActor(RE::Actor* a_actor)
 		{
-			auto npc = a_actor->GetNPC();
-			return Get(npc->formRace, npc->GetSex());
+			auto                                npc = a_actor->GetNPC();
+			RuleSetCollection_T::const_accessor acc;
+			if (m_per_race_sex_ruleset.find(acc, npc->formRace)) {
+				return acc->second[static_cast<std::size_t>(npc->GetSex())];
+			}
+			return nullptr;
 		}
 
 		void ClearAllRulesets()
 		{
 			m_per_race_sex_ruleset.clear();
+			m_fingerprints.clear();
 		}
 
+		// Only rebuilds the race/sex rulesets whose source files changed since the last load, the rest stay alive
 		void LoadRulesets(std::string a_rootFolder);
 
+		// Sum of the evaluation stats of every installed ruleset, must not run concurrently with LoadRulesets()
+		MorphEvaluationRuleSet::EvaluationStats GetEvaluationStats() const
+		{
+			MorphEvaluationRuleSet::EvaluationStats     total;
+			std::unordered_set<MorphEvaluationRuleSet*> counted;  // Both sexes may share a ruleset
+			for (auto& [race, rulesets] : m_per_race_sex_ruleset) {
+				for (auto& ruleset : rulesets) {
+					if (ruleset && counted.insert(ruleset.get()).second) {
+						auto stats = ruleset->GetEvaluationStats();
+						total.rules_evaluated += stats.rules_evaluated;
+						total.rules_skipped += stats.rules_skipped;
+					}
+				}
+			}
+			return total;
+		}
+
 		// Loading order is always: master.json -> alphabetical order of other files
 		bool LoadRaceSexRulesets(std::filesystem::path a_sexFolder, RE::TESRace* a_race, RE::SEX a_sex);
 
@@ -322,5 +614,53 @@ namespace daf
 
 		// Always returns a valid ruleset, existing or new
 		MorphEvaluationRuleSet* GetOrCreate(RE::TESRace* a_race, const RE::SEX a_sex, bool& is_new);
+
+		// Parses a_filename into a_ruleset through the RulesetCache
+		bool ParseScript(MorphEvaluationRuleSet* a_ruleset, const std::string& a_filename, bool a_clearExisting, MorphEvaluationRuleSet::CollisionBehavior a_behavior = MorphEvaluationRuleSet::CollisionBehavior::kOverwrite);
+
+		bool m_script_cache_loaded{ false };
+
+		// Paths, sizes and write times of the files each race/sex ruleset was built from, empty until a build succeeds
+		std::unordered_map<RE::TESRace*, std::array<std::optional<std::uint64_t>, 2>> m_fingerprints;
+
+		static std::uint64_t FingerprintSources(const std::string& a_raceMasterFile, const std::filesystem::path& a_sexFolder);
+
+		// Replaces the ruleset of a race/sex, nullptr removes it
+		void Set(RE::TESRace* a_race, const RE::SEX a_sex, std::shared_ptr<MorphEvaluationRuleSet> a_ruleset)
+		{
+			RuleSetCollection_T::accessor acc;
+			if (!m_per_race_sex_ruleset.find(acc, a_race)) {
+				m_per_race_sex_ruleset.insert(acc, std::make_pair(a_race, std::array<std::shared_ptr<MorphEvaluationRuleSet>, 2>{ nullptr, nullptr }));
+			}
+			acc->second[static_cast<std::size_t>(a_sex)] = std::move(a_ruleset);
+		}
+
+		// One race/sex ruleset to (re)build, filled in by BuildRuleset()
+		struct LoadJob
+		{
+			RE::TESRace*          race{ nullptr };
+			RE::SEX               sex{ RE::SEX::kMale };
+			std::string           folder_name;
+			std::string           race_master_file;
+			std::filesystem::path sex_folder;
+			std::uint64_t         fingerprint{ 0 };
+
+			// Read once per race before the builds start, the jobs of both sexes point to the same script
+			const MorphEvaluationRuleSet::ParsedScript* race_master_script{ nullptr };
+
+			// Index of the job building the ruleset this job shares, itself if it builds its own
+			std::size_t source_job{ 0 };
+
+			std::shared_ptr<MorphEvaluationRuleSet> ruleset;
+			bool                                    failed{ false };  // A file couldn't be read or parsed
+			long long                               elapsed_ms{ 0 };
+		};
+
+		// Parses and compiles a job's ruleset without touching m_per_race_sex_ruleset, safe to run concurrently
+		void BuildRuleset(LoadJob& a_job);
+
+		// Loading order is always: master.json -> alphabetical order of other files. Returns false if there's no master.json,
+		// a_parsed is set to false if any file couldn't be read or parsed
+		bool ParseSexFolder(MorphEvaluationRuleSet* a_ruleset, const std::filesystem::path& a_sexFolder, bool a_clearExisting, bool* a_parsed = nullptr);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,110 @@
+#pragma once
+#include "SingletonBase.h"
+
+namespace daf
+{
+	inline constexpr std::string_view overweightMorphName{ "Overweight" };
+	inline constexpr std::string_view strongMorphName{ "Strong" };
+	inline constexpr std::string_view thinMorphName{ "Thin" };
+
+	namespace tokens
+	{
+		inline constexpr std::string general_offset{ "ECOffset_" };
+	}
+
+	using MorphID = std::uint32_t;
+
+	inline constexpr MorphID NoMorphID = std::numeric_limits<MorphID>::max();
+
+	// Process-wide ids of morph names, assigned while rulesets load. Registering a morph also registers its offset morph
+	// (tokens::general_offset + name), and both keep the game string handle used to index shapeBlendData.
+	// Entries are never removed or moved, so ids, names and handles stay valid for the lifetime of the process.
+	class MorphNameRegistry :
+		public utils::SingletonBase<MorphNameRegistry>
+	{
+		friend class utils::SingletonBase<MorphNameRegistry>;
+
+	public:
+		// Morphs stored in TESNPC::morphWeight instead of shapeBlendData
+		enum class WeightMorph : std::uint8_t
+		{
+			kNone,
+			kFat,
+			kMuscular,
+			kThin
+		};
+
+		struct Entry
+		{
+			std::string         name;
+			RE::BSFixedStringCS fixed_name;
+			MorphID             offset_id{ NoMorphID };  // NoMorphID for offset morphs themselves
+			WeightMorph         weight{ WeightMorph::kNone };
+		};
+
+		// Returns the id of a_name, registering it and its offset morph if needed. Thread-safe
+		MorphID Register(std::string_view a_name)
+		{
+			if (auto id = Find(a_name); id != NoMorphID) {
+				return id;
+			}
+
+			std::unique_lock lock(m_mutex);
+			if (auto it = m_ids.find(a_name); it != m_ids.end()) {  // Registered by another thread meanwhile
+				return it->second;
+			}
+
+			auto id = Insert(std::string(a_name));
+			auto offset_id = Insert(tokens::general_offset + std::string(a_name));
+			m_entries[id].offset_id = offset_id;
+			return id;
+		}
+
+		// NoMorphID if a_name was never registered
+		MorphID Find(std::string_view a_name) const
+		{
+			std::shared_lock lock(m_mutex);
+			if (auto it = m_ids.find(a_name); it != m_ids.end()) {
+				return it->second;
+			}
+			return NoMorphID;
+		}
+
+		// Lock-free, a_id must come from Register() or Find()
+		const Entry& Get(MorphID a_id) const
+		{
+			return m_entries[a_id];
+		}
+
+		std::size_t Size() const
+		{
+			return m_entries.size();
+		}
+
+	private:
+		MorphNameRegistry() = default;
+
+		mutable std::shared_mutex                     m_mutex;
+		std::unordered_map<std::string_view, MorphID> m_ids;  // Keys view Entry::name
+		tbb::concurrent_vector<Entry>                 m_entries;
+
+		// Requires m_mutex held exclusively
+		MorphID Insert(std::string a_name)
+		{
+			auto weight = WeightMorph::kNone;
+			if (a_name == overweightMorphName) {
+				weight = WeightMorph::kFat;
+			} else if (a_name == strongMorphName) {
+				weight = WeightMorph::kMuscular;
+			} else if (a_name == thinMorphName) {
+				weight = WeightMorph::kThin;
+			}
+
+			RE::BSFixedStringCS fixed_name(std::string_view{ a_name });
+			auto                it = m_entries.emplace_back(std::move(a_name), std::move(fixed_name), NoMorphID, weight);
+			auto                id = static_cast<MorphID>(it - m_entries.begin());
+			m_ids.emplace(it->name, id);
+			return id;
+		}
+	};
+}
@@ -28,6 +28,11 @@ namespace mutex
 			}
 		}
 
+		bool try_lock()
+		{
+			return !flag.test_and_set(std::memory_order_acquire);
+		}
+
 		void unlock()
 		{
 			flag.clear(std::memory_order_release);
@@ -0,0 +1,238 @@
+#pragma once
+#include "MutexUtils.h"
+#include "Utils.h"
+
+namespace daf
+{
+	// Actors waiting for a morph reevaluation, a share of them is granted their reevaluation once per frame under a time budget.
+	// Order: the player, then actors deferred for longer than a_maxDeferral_ms (oldest first), then the nearest actors.
+	// Actors left when the budget runs out are carried over to the next frame, keeping their original request time.
+	// A granted actor reevaluates itself on its own update, so it only touches its own data from its own thread:
+	// it takes its grant with Take() and reports the time it spent with Report(), which calibrates how many actors fit the budget.
+	// Requests are kept by form id, actors are looked up again when processed and dropped if they're gone or unloaded.
+	// Request(), Cancel(), Take() and Report() may be called from any thread, Process() from the thread driving the frame.
+	class ReevaluationScheduler
+	{
+	public:
+		struct FrameStats
+		{
+			std::uint32_t granted{ 0 };
+			std::uint32_t carried_over{ 0 };
+			std::uint32_t dropped{ 0 };      // Actors deleted or unloaded while queued
+			float         elapsed_ms{ 0.f };  // Reported by the granted actors
+			bool          overrun{ false };   // The granted actors took longer than the budget
+		};
+
+		struct Stats
+		{
+			std::uint64_t frames{ 0 };
+			std::uint64_t granted{ 0 };
+			std::uint64_t overruns{ 0 };
+			std::uint64_t dropped{ 0 };
+			FrameStats    last_frame;
+		};
+
+		struct Grant
+		{
+			bool                       forced{ false };
+			std::vector<RE::TESFormID> changed_armors;
+		};
+
+		// Assumed cost of a reevaluation until the first ones are reported
+		static constexpr float InitialCostEstimate_ms = 0.25f;
+
+		// a_forced requests stay forced when merged with a later request of the same actor.
+		// a_changedArmors are the armors equipped or unequipped since the actor's last reevaluation, merged requests keep them all.
+		// An actor already granted but not reevaluated yet gets the request merged into its grant
+		void Request(RE::Actor* a_actor, time_t a_when, bool a_forced = false, std::span<const RE::TESFormID> a_changedArmors = {})
+		{
+			std::lock_guard lock(m_lock);
+			if (auto it = m_granted.find(a_actor->formID); it != m_granted.end()) {
+				it->second.forced |= a_forced;
+				MergeArmors(it->second.changed_armors, a_changedArmors);
+				return;
+			}
+			auto [it, inserted] = m_pending.try_emplace(a_actor->formID, Request_T{ a_actor->formID, nullptr, a_when, a_forced });
+			if (!inserted) {
+				it->second.forced |= a_forced;
+			}
+			MergeArmors(it->second.changed_armors, a_changedArmors);
+		}
+
+		void Cancel(RE::TESFormID a_formID)
+		{
+			std::lock_guard lock(m_lock);
+			m_pending.erase(a_formID);
+			m_granted.erase(a_formID);
+		}
+
+		void Clear()
+		{
+			std::lock_guard lock(m_lock);
+			m_pending.clear();
+			m_granted.clear();
+		}
+
+		bool IsPending(RE::TESFormID a_formID)
+		{
+			std::lock_guard lock(m_lock);
+			return m_pending.contains(a_formID) || m_granted.contains(a_formID);
+		}
+
+		// Grants queued actors in priority order until their estimated cost reaches a_budget_ms, at least one actor is granted.
+		// a_grant(actor) notifies the actor, it returns false if the actor can't take its grant and the request is dropped.
+		// The returned frame's elapsed time is only known once its actors reported, see Stats::last_frame
+		template <class _Grant_T>
+		FrameStats Process(RE::Actor* a_player, time_t a_now, float a_budget_ms, time_t a_maxDeferral_ms, _Grant_T&& a_grant)
+		{
+			{
+				std::lock_guard lock(m_lock);
+
+				// The actors granted last frame have reevaluated since
+				m_frame.elapsed_ms = m_frame_cost_ms;
+				m_frame.overrun = m_frame_cost_ms > a_budget_ms;
+				m_frame_cost_ms = 0.f;
+				if (m_stats.frames++ > 0) {
+					m_stats.overruns += m_frame.overrun;
+					m_stats.last_frame = m_frame;
+				}
+				m_frame = {};
+
+				m_queue.clear();
+				for (auto& [actor, request] : m_pending) {
+					m_queue.emplace_back(std::move(request));
+				}
+				m_pending.clear();
+
+				std::erase_if(m_granted, [](const auto& a_grant) { return utils::GetLoadedActor(a_grant.first) == nullptr; });
+			}
+
+			m_frame.dropped = static_cast<std::uint32_t>(std::erase_if(m_queue, [](Request_T& a_request) {
+				a_request.actor = utils::GetLoadedActor(a_request.form_id);
+				return a_request.actor == nullptr;
+			}));
+
+			if (!m_queue.empty()) {
+				for (auto& request : m_queue) {
+					if (request.actor == a_player) {
+						request.rank = 0;
+					} else if (a_now - request.requested > a_maxDeferral_ms) {
+						request.rank = 1;
+					} else {
+						request.rank = 2;
+					}
+					request.distance = request.rank == 2 && a_player ? utils::GetDistanceSquared(request.actor, a_player) : 0.f;
+				}
+				std::ranges::sort(m_queue, [](const Request_T& a_lhs, const Request_T& a_rhs) {
+					if (a_lhs.rank != a_rhs.rank) {
+						return a_lhs.rank < a_rhs.rank;
+					}
+					if (a_lhs.distance != a_rhs.distance) {
+						return a_lhs.distance < a_rhs.distance;
+					}
+					return a_lhs.requested < a_rhs.requested;
+				});
+
+				std::size_t next = 0;
+				{
+					std::lock_guard lock(m_lock);
+					auto            estimate_ms = m_cost_estimate_ms;
+					for (; next < m_queue.size() && (next == 0 || (next + 1) * estimate_ms <= a_budget_ms); ++next) {
+						auto& request = m_queue[next];
+						auto& grant = m_granted[request.form_id];
+						grant.forced |= request.forced;
+						MergeArmors(grant.changed_armors, request.changed_armors);
+					}
+				}
+
+				// Notified once their grant is in place, an actor may take it right away from its own thread
+				for (std::size_t i = 0; i < next; ++i) {
+					if (a_grant(m_queue[i].actor)) {
+						++m_frame.granted;
+					} else {
+						Cancel(m_queue[i].form_id);
+					}
+				}
+				m_frame.carried_over = static_cast<std::uint32_t>(m_queue.size() - next);
+
+				if (next < m_queue.size()) {
+					std::lock_guard lock(m_lock);
+					for (; next < m_queue.size(); ++next) {
+						auto& request = m_queue[next];
+						auto [it, inserted] = m_pending.try_emplace(request.form_id, std::move(request));
+						if (!inserted) {  // Requested again meanwhile, the older request time decides the priority
+							it->second.requested = request.requested;
+							it->second.forced |= request.forced;
+							MergeArmors(it->second.changed_armors, request.changed_armors);
+						}
+					}
+				}
+			}
+
+			std::lock_guard lock(m_lock);
+			m_stats.granted += m_frame.granted;
+			m_stats.dropped += m_frame.dropped;
+			return m_frame;
+		}
+
+		// Moves the grant of a_formID into a_grant, false if the actor wasn't granted or its grant was cancelled
+		bool Take(RE::TESFormID a_formID, Grant& a_grant)
+		{
+			std::lock_guard lock(m_lock);
+			auto            it = m_granted.find(a_formID);
+			if (it == m_granted.end()) {
+				return false;
+			}
+			a_grant = std::move(it->second);
+			m_granted.erase(it);
+			return true;
+		}
+
+		// Time a granted actor spent reevaluating on its own update
+		void Report(float a_elapsed_ms)
+		{
+			std::lock_guard lock(m_lock);
+			m_frame_cost_ms += a_elapsed_ms;
+			m_cost_estimate_ms += (a_elapsed_ms - m_cost_estimate_ms) / 8.f;
+		}
+
+		Stats GetStats() const
+		{
+			std::lock_guard lock(m_lock);
+			return m_stats;
+		}
+
+	private:
+		struct Request_T
+		{
+			RE::TESFormID form_id{ 0 };
+			RE::Actor*    actor{ nullptr };  // Looked up by Process(), only valid during the frame
+			time_t        requested{ 0 };
+			bool          forced{ false };
+
+			std::vector<RE::TESFormID> changed_armors;  // Each armor once, in event order
+
+			// Priority, computed by Process()
+			std::uint8_t rank{ 0 };
+			float        distance{ 0.f };
+		};
+
+		mutable mutex::NonReentrantSpinLock          m_lock;
+		std::unordered_map<RE::TESFormID, Request_T> m_pending;
+		std::unordered_map<RE::TESFormID, Grant>     m_granted;  // Granted, waiting for the actor's update
+		std::vector<Request_T>                       m_queue;    // Only used by Process()
+		FrameStats                                   m_frame;    // Granted by the last Process(), its elapsed time is known at the next one
+		float                                        m_frame_cost_ms{ 0.f };
+		float                                        m_cost_estimate_ms{ InitialCostEstimate_ms };
+		Stats                                        m_stats;
+
+		static void MergeArmors(std::vector<RE::TESFormID>& a_armors, std::span<const RE::TESFormID> a_changedArmors)
+		{
+			for (auto armor : a_changedArmors) {
+				if (std::ranges::find(a_armors, armor) == a_armors.end()) {
+					a_armors.emplace_back(armor);
+				}
+			}
+		}
+	};
+}
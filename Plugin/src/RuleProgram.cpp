@@ -0,0 +1,976 @@
+#include "RuleProgram.h"
+
+namespace
+{
+	inline bool IsTrue(float v)
+	{
+		return v != 0.f;
+	}
+
+	template <class _Op_T>
+	inline void UnaryLanes(float* __restrict d, const float* __restrict a, std::size_t n, _Op_T op)
+	{
+		for (std::size_t l = 0; l < n; ++l) {
+			d[l] = op(a[l]);
+		}
+	}
+
+	template <class _Op_T>
+	inline void BinaryLanes(float* __restrict d, const float* __restrict a, const float* __restrict b, std::size_t n, _Op_T op)
+	{
+		for (std::size_t l = 0; l < n; ++l) {
+			d[l] = op(a[l], b[l]);
+		}
+	}
+
+	template <class _Op_T>
+	inline void TernaryLanes(float* __restrict d, const float* __restrict a, const float* __restrict b, const float* __restrict c, std::size_t n, _Op_T op)
+	{
+		for (std::size_t l = 0; l < n; ++l) {
+			d[l] = op(a[l], b[l], c[l]);
+		}
+	}
+
+	// Which operands of an instruction are registers, the others are slots, constants, fallbacks or exponents
+	int NumRegisterOperands(daf::RuleProgram::OpCode a_op)
+	{
+		using OpCode = daf::RuleProgram::OpCode;
+		switch (a_op) {
+		case OpCode::kConst:
+		case OpCode::kLoad:
+		case OpCode::kFallback:
+			return 0;
+		case OpCode::kNeg:
+		case OpCode::kNot:
+		case OpCode::kAbs:
+		case OpCode::kSqrt:
+		case OpCode::kFloor:
+		case OpCode::kCeil:
+		case OpCode::kIPow:
+		case OpCode::kIPowInv:
+			return 1;
+		case OpCode::kClamp:
+		case OpCode::kSelect:
+			return 3;
+		default:
+			return 2;
+		}
+	}
+
+	inline std::string ToLower(std::string_view a_str)
+	{
+		std::string result(a_str);
+		std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		return result;
+	}
+
+	// Binary operators and their (left, right) precedence, matching exprtk's parser::parse_expression
+	bool GetBinaryOperator(std::string_view a_token, bool a_isSymbol, daf::RuleProgram::OpCode& op, int& left, int& right, bool& unsupported)
+	{
+		using OpCode = daf::RuleProgram::OpCode;
+		unsupported = false;
+
+		if (a_isSymbol) {
+			auto symbol = ToLower(a_token);
+			if (symbol == "and") {
+				op = OpCode::kAnd, left = 3, right = 4;
+				return true;
+			} else if (symbol == "or") {
+				op = OpCode::kOr, left = 1, right = 2;
+				return true;
+			} else if (symbol == "nand" || symbol == "nor" || symbol == "xor" || symbol == "xnor" || symbol == "in" || symbol == "like" || symbol == "ilike") {
+				unsupported = true;
+			}
+			return false;
+		}
+
+		if (a_token == "|") {
+			op = OpCode::kOr, left = 1, right = 2;
+		} else if (a_token == "&") {
+			op = OpCode::kAnd, left = 3, right = 4;
+		} else if (a_token == "<") {
+			op = OpCode::kLt, left = 5, right = 6;
+		} else if (a_token == "<=") {
+			op = OpCode::kLte, left = 5, right = 6;
+		} else if (a_token == ">") {
+			op = OpCode::kGt, left = 5, right = 6;
+		} else if (a_token == ">=") {
+			op = OpCode::kGte, left = 5, right = 6;
+		} else if (a_token == "==" || a_token == "=") {
+			op = OpCode::kEq, left = 5, right = 6;
+		} else if (a_token == "!=" || a_token == "<>") {
+			op = OpCode::kNe, left = 5, right = 6;
+		} else if (a_token == "+") {
+			op = OpCode::kAdd, left = 7, right = 8;
+		} else if (a_token == "-") {
+			op = OpCode::kSub, left = 7, right = 8;
+		} else if (a_token == "*") {
+			op = OpCode::kMul, left = 10, right = 11;
+		} else if (a_token == "/") {
+			op = OpCode::kDiv, left = 10, right = 11;
+		} else if (a_token == "%") {
+			op = OpCode::kMod, left = 10, right = 11;
+		} else if (a_token == "^") {
+			op = OpCode::kPow, left = 12, right = 12;
+		} else {
+			return false;
+		}
+		return true;
+	}
+}
+
+daf::RuleProgram::Builder::Builder(const std::unordered_map<std::string, std::uint32_t>& a_slots, std::uint32_t a_numSlots, const exprtk::symbol_table<float>& a_symbolTable) :
+	m_slots(a_slots),
+	m_symbol_table(a_symbolTable),
+	m_program(std::make_unique<RuleProgram>())
+{
+	m_program->m_num_slots = a_numSlots;
+}
+
+void daf::RuleProgram::Builder::BeginMorph(std::string_view a_morphName)
+{
+	if (m_in_morph) {
+		EndMorph();
+	}
+
+	auto& block = m_program->m_blocks.emplace_back();
+	block.morph_name = a_morphName;
+	block.begin = static_cast<std::uint32_t>(m_program->m_code.size());
+	block.first_term = static_cast<std::uint32_t>(m_program->m_terms.size());
+	m_in_morph = true;
+}
+
+bool daf::RuleProgram::Builder::AddRule(const std::string& a_expr, bool a_isSetter, Fallback* a_rule, bool a_forceFallback)
+{
+	auto& block = m_program->m_blocks.back();
+	if (block.is_setter) {  // A Setter decides the morph alone, later rules are never evaluated
+		m_program->m_num_dead_rules++;
+		return true;
+	}
+
+	auto code_mark = m_program->m_code.size();
+	auto const_mark = m_program->m_constants.size();
+
+	m_failed = a_forceFallback || !Tokenize(a_expr);
+
+	std::uint32_t reg = 0;
+	if (!m_failed) {
+		reg = ParseExpression(0);
+		if (!m_failed && Peek().type != Token::Type::kEnd) {
+			m_failed = true;
+		}
+	}
+
+	bool lowered = !m_failed;
+	if (!lowered) {
+		m_program->m_code.resize(code_mark);
+		m_program->m_constants.resize(const_mark);
+		reg = Emit(OpCode::kFallback, static_cast<std::uint32_t>(m_program->m_fallbacks.size()));
+		m_program->m_fallbacks.emplace_back(a_rule);
+	}
+
+	auto& output = m_program->m_rule_outputs.emplace_back(a_rule, reg, lowered);
+	if (lowered && IsConst(reg)) {
+		output.constant = true;
+		output.value = ConstValue(reg);
+		m_program->m_num_folded_rules++;
+	}
+
+	if (a_isSetter) {
+		m_program->m_num_dead_rules += block.num_terms;
+		block.is_setter = true;
+		block.first_term = static_cast<std::uint32_t>(m_program->m_terms.size());
+		block.num_terms = 0;
+	} else if (output.constant && output.value == 0.f) {
+		// Adders start from +0, so adding a zero of either sign never changes the sum
+		m_program->m_num_dead_rules++;
+		m_tokens.clear();
+		m_cursor = 0;
+		return lowered;
+	}
+	m_program->m_terms.emplace_back(reg);
+	block.num_terms++;
+
+	m_tokens.clear();
+	m_cursor = 0;
+	return lowered;
+}
+
+void daf::RuleProgram::Builder::EndMorph()
+{
+	if (!m_in_morph) {
+		return;
+	}
+	m_program->m_blocks.back().end = static_cast<std::uint32_t>(m_program->m_code.size());
+	m_in_morph = false;
+}
+
+std::unique_ptr<daf::RuleProgram> daf::RuleProgram::Builder::Finish()
+{
+	EndMorph();
+
+	FoldStaticBlocks();
+	m_program->EliminateCommonSubexpressions();
+
+	auto& code = m_program->m_code;
+	for (std::uint32_t i = 0; i < code.size(); ++i) {
+		if (code[i].op == OpCode::kFallback) {
+			m_program->m_fallback_code.emplace_back(i);
+		}
+	}
+
+	return std::move(m_program);
+}
+
+bool daf::RuleProgram::Builder::Tokenize(const std::string& a_expr)
+{
+	m_tokens.clear();
+	m_cursor = 0;
+
+	std::size_t i = 0;
+	const std::size_t n = a_expr.size();
+	while (i < n) {
+		char c = a_expr[i];
+		if (std::isspace(static_cast<unsigned char>(c))) {
+			++i;
+			continue;
+		}
+
+		if (std::isdigit(static_cast<unsigned char>(c)) || (c == '.' && i + 1 < n && std::isdigit(static_cast<unsigned char>(a_expr[i + 1])))) {
+			std::size_t begin = i;
+			while (i < n && std::isdigit(static_cast<unsigned char>(a_expr[i]))) {
+				++i;
+			}
+			if (i < n && a_expr[i] == '.') {
+				++i;
+				while (i < n && std::isdigit(static_cast<unsigned char>(a_expr[i]))) {
+					++i;
+				}
+			}
+			if (i < n && (a_expr[i] == 'e' || a_expr[i] == 'E')) {
+				++i;
+				if (i < n && (a_expr[i] == '+' || a_expr[i] == '-')) {
+					++i;
+				}
+				if (i >= n || !std::isdigit(static_cast<unsigned char>(a_expr[i]))) {
+					return false;
+				}
+				while (i < n && std::isdigit(static_cast<unsigned char>(a_expr[i]))) {
+					++i;
+				}
+			}
+			m_tokens.emplace_back(Token::Type::kNumber, a_expr.substr(begin, i - begin));
+			continue;
+		}
+
+		if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+			std::size_t begin = i;
+			while (i < n && (std::isalnum(static_cast<unsigned char>(a_expr[i])) || a_expr[i] == '_' || a_expr[i] == '.')) {
+				++i;
+			}
+			m_tokens.emplace_back(Token::Type::kSymbol, a_expr.substr(begin, i - begin));
+			continue;
+		}
+
+		if (i + 1 < n) {
+			auto two = a_expr.substr(i, 2);
+			if (two == ":=" || two == "&&" || two == "||") {
+				return false;
+			}
+			if (two == "<=" || two == ">=" || two == "==" || two == "!=" || two == "<>") {
+				m_tokens.emplace_back(Token::Type::kOperator, two);
+				i += 2;
+				continue;
+			}
+		}
+
+		if (std::string_view("+-*/%^<>=&|?:(),").find(c) != std::string_view::npos) {
+			m_tokens.emplace_back(Token::Type::kOperator, std::string(1, c));
+			++i;
+			continue;
+		}
+
+		return false;  // Statements, strings, vectors etc. stay with exprtk
+	}
+
+	m_tokens.emplace_back(Token::Type::kEnd, std::string());
+	return true;
+}
+
+bool daf::RuleProgram::Builder::Expect(std::string_view a_op)
+{
+	if (!PeekOperator(a_op)) {
+		m_failed = true;
+		return false;
+	}
+	++m_cursor;
+	return true;
+}
+
+std::uint32_t daf::RuleProgram::Builder::ParseExpression(int a_precedence)
+{
+	auto lhs = ParseBranch();
+
+	while (!m_failed) {
+		auto& token = Peek();
+		if (token.type != Token::Type::kOperator && token.type != Token::Type::kSymbol) {
+			break;
+		}
+
+		OpCode op;
+		int    left, right;
+		bool   unsupported;
+		if (!GetBinaryOperator(token.text, token.type == Token::Type::kSymbol, op, left, right, unsupported)) {
+			if (unsupported) {
+				return Fail();
+			}
+			break;
+		}
+
+		if (left < a_precedence) {
+			break;
+		}
+
+		++m_cursor;
+		auto rhs = ParseExpression(right);
+		if (m_failed) {
+			return 0;
+		}
+
+		lhs = op == OpCode::kPow ? EmitPow(lhs, rhs) : Emit(op, lhs, rhs);
+
+		if (a_precedence == 0 && PeekOperator("?")) {
+			lhs = ParseTernary(lhs);
+		}
+	}
+
+	if (!m_failed && a_precedence == 0 && PeekOperator("?")) {
+		lhs = ParseTernary(lhs);
+	}
+
+	return m_failed ? 0 : lhs;
+}
+
+std::uint32_t daf::RuleProgram::Builder::ParseBranch()
+{
+	auto token = Peek();
+	switch (token.type) {
+	case Token::Type::kNumber:
+		{
+			++m_cursor;
+			float value = 0.f;
+			if (!exprtk::details::string_to_real(token.text, value)) {
+				return Fail();
+			}
+			return EmitConst(value);
+		}
+	case Token::Type::kSymbol:
+		{
+			++m_cursor;
+			auto symbol = ToLower(token.text);
+			if (PeekOperator("(")) {
+				return ParseFunction(symbol);
+			}
+			return ParseSymbol(symbol);
+		}
+	case Token::Type::kOperator:
+		if (token.text == "(") {
+			++m_cursor;
+			auto reg = ParseExpression(0);
+			if (m_failed || !Expect(")")) {
+				return Fail();
+			}
+			return reg;
+		} else if (token.text == "-") {
+			++m_cursor;
+			auto reg = ParseExpression(11);
+			if (m_failed) {
+				return 0;
+			}
+			// Negative literals are folded by Emit() like exprtk does, which matters for x^-2
+			return Emit(OpCode::kNeg, reg);
+		} else if (token.text == "+") {
+			++m_cursor;
+			return ParseExpression(13);
+		}
+		return Fail();
+	default:
+		return Fail();
+	}
+}
+
+std::uint32_t daf::RuleProgram::Builder::ParseSymbol(const std::string& a_symbol)
+{
+	if (auto it = m_slots.find(a_symbol); it != m_slots.end()) {
+		return Emit(OpCode::kLoad, it->second);
+	}
+
+	if (a_symbol == "true") {
+		return EmitConst(1.f);
+	} else if (a_symbol == "false") {
+		return EmitConst(0.f);
+	}
+
+	// Constants registered through symbol_table::add_constants()
+	if (m_symbol_table.is_constant_node(a_symbol)) {
+		if (auto var = m_symbol_table.get_variable(a_symbol); var) {
+			return EmitConst(var->value());
+		}
+	}
+
+	return Fail();
+}
+
+std::uint32_t daf::RuleProgram::Builder::ParseFunction(const std::string& a_function)
+{
+	if (!Expect("(")) {
+		return 0;
+	}
+
+	std::vector<std::uint32_t> args;
+	if (!PeekOperator(")")) {
+		for (;;) {
+			args.emplace_back(ParseExpression(0));
+			if (m_failed) {
+				return 0;
+			}
+			if (PeekOperator(",")) {
+				++m_cursor;
+				continue;
+			}
+			break;
+		}
+	}
+	if (!Expect(")")) {
+		return 0;
+	}
+
+	auto unary = [&](OpCode op) -> std::uint32_t {
+		return args.size() == 1 ? Emit(op, args[0]) : Fail();
+	};
+
+	if (a_function == "abs") {
+		return unary(OpCode::kAbs);
+	} else if (a_function == "sqrt") {
+		return unary(OpCode::kSqrt);
+	} else if (a_function == "floor") {
+		return unary(OpCode::kFloor);
+	} else if (a_function == "ceil") {
+		return unary(OpCode::kCeil);
+	} else if (a_function == "not") {
+		return unary(OpCode::kNot);
+	} else if (a_function == "min" || a_function == "max") {
+		if (args.size() < 2) {
+			return Fail();
+		}
+		auto op = a_function == "min" ? OpCode::kMin : OpCode::kMax;
+		auto reg = args[0];
+		for (std::size_t i = 1; i < args.size(); ++i) {
+			reg = Emit(op, reg, args[i]);
+		}
+		return reg;
+	} else if (a_function == "clamp") {
+		return args.size() == 3 ? Emit(OpCode::kClamp, args[0], args[1], args[2]) : Fail();
+	} else if (a_function == "if") {
+		return args.size() == 3 ? Emit(OpCode::kSelect, args[0], args[1], args[2]) : Fail();
+	} else if (a_function == "pow") {
+		return args.size() == 2 ? EmitPow(args[0], args[1]) : Fail();
+	}
+
+	return Fail();
+}
+
+std::uint32_t daf::RuleProgram::Builder::ParseTernary(std::uint32_t a_condition)
+{
+	if (!Expect("?")) {
+		return 0;
+	}
+	auto consequent = ParseExpression(0);
+	if (m_failed || !Expect(":")) {
+		return Fail();
+	}
+	auto alternative = ParseExpression(0);
+	if (m_failed) {
+		return 0;
+	}
+	return Emit(OpCode::kSelect, a_condition, consequent, alternative);
+}
+
+std::uint32_t daf::RuleProgram::Builder::EmitConst(float a_value)
+{
+	auto index = static_cast<std::uint32_t>(m_program->m_constants.size());
+	m_program->m_constants.emplace_back(a_value);
+	return Emit(OpCode::kConst, index);
+}
+
+std::uint32_t daf::RuleProgram::Builder::Emit(OpCode a_op, std::uint32_t a_a, std::uint32_t a_b, std::uint32_t a_c)
+{
+	auto dst = static_cast<std::uint32_t>(m_program->m_code.size());
+	m_program->m_code.emplace_back(a_op, dst, a_a, a_b, a_c);
+	return Fold(dst);
+}
+
+std::uint32_t daf::RuleProgram::Builder::Fold(std::uint32_t a_reg)
+{
+	auto ins = m_program->m_code[a_reg];
+	auto num_operands = NumRegisterOperands(ins.op);
+	if (num_operands == 0) {
+		return a_reg;
+	}
+
+	// if(c, x, y) with a constant condition is just the selected branch
+	if (ins.op == OpCode::kSelect && IsConst(ins.a)) {
+		return IsTrue(ConstValue(ins.a)) ? ins.b : ins.c;
+	}
+
+	std::uint32_t operands[3]{ ins.a, ins.b, ins.c };
+	float         values[3]{};
+	for (int i = 0; i < num_operands; ++i) {
+		if (!IsConst(operands[i])) {
+			return a_reg;
+		}
+		values[i] = ConstValue(operands[i]);
+	}
+
+	// Same arithmetic as Run(), on a register file holding just the operands.
+	// The operand instructions stay behind unused and are dropped in Finish().
+	ins.a = 0;
+	if (num_operands > 1) {
+		ins.b = 1;
+		ins.c = 2;
+	}
+	auto index = static_cast<std::uint32_t>(m_program->m_constants.size());
+	m_program->m_constants.emplace_back(Compute(ins, values));
+	m_program->m_code[a_reg] = { OpCode::kConst, a_reg, index };
+	return a_reg;
+}
+
+void daf::RuleProgram::Builder::FoldStaticBlocks()
+{
+	auto& program = *m_program;
+	for (auto& block : program.m_blocks) {
+		auto terms = std::span(program.m_terms).subspan(block.first_term, block.num_terms);
+		if (!std::ranges::all_of(terms, [this](std::uint32_t a_term) { return IsConst(a_term); })) {
+			continue;
+		}
+
+		// The value Accumulate() would compute every time
+		float value = 0.f;
+		if (block.is_setter) {
+			value = ConstValue(terms.front());
+		} else {
+			for (auto term : terms) {
+				value += ConstValue(term);
+			}
+		}
+
+		block.is_static = true;
+		block.static_value = value;
+		program.m_num_static_morphs++;
+	}
+}
+
+std::uint32_t daf::RuleProgram::Builder::EmitPow(std::uint32_t a_base, std::uint32_t a_exponent)
+{
+	// exprtk replaces x^c with repeated multiplication for integer |c| <= 60, mirror it to stay bit-identical
+	auto& exponent = m_program->m_code[a_exponent];
+	if (exponent.op == OpCode::kConst) {
+		float c = m_program->m_constants[exponent.a];
+		if (std::abs(c) <= 60.f && std::fmod(c, 1.f) == 0.f) {
+			auto p = static_cast<std::uint32_t>(static_cast<int>(std::abs(c)));
+			if (p == 0) {
+				return EmitConst(1.f);
+			} else if (c == 2.f) {
+				return Emit(OpCode::kMul, a_base, a_base);
+			}
+			return Emit(c >= 0.f ? OpCode::kIPow : OpCode::kIPowInv, a_base, p);
+		}
+	}
+	return Emit(OpCode::kPow, a_base, a_exponent);
+}
+
+void daf::RuleProgram::EliminateCommonSubexpressions()
+{
+	const auto num_code = static_cast<std::uint32_t>(m_code.size());
+
+	std::vector<std::uint32_t> block_of(num_code, 0);
+	for (std::uint32_t b = 0; b < m_blocks.size(); ++b) {
+		std::fill(block_of.begin() + m_blocks[b].begin, block_of.begin() + m_blocks[b].end, b);
+	}
+
+	// Only instructions some term of a non-static block depends on are kept, this drops folded operands,
+	// static blocks and rules overridden by a Setter. Operands always precede their users.
+	std::vector<bool> live(num_code, false);
+	for (auto& block : m_blocks) {
+		if (!block.is_static) {
+			for (std::uint32_t i = 0; i < block.num_terms; ++i) {
+				live[m_terms[block.first_term + i]] = true;
+			}
+		}
+	}
+	std::uint32_t num_live = 0;
+	for (std::uint32_t i = num_code; i-- > 0;) {
+		if (!live[i]) {
+			continue;
+		}
+		num_live++;
+		auto& ins = m_code[i];
+		switch (NumRegisterOperands(ins.op)) {
+		case 3:
+			live[ins.c] = true;
+			[[fallthrough]];
+		case 2:
+			live[ins.b] = true;
+			[[fallthrough]];
+		case 1:
+			live[ins.a] = true;
+			break;
+		}
+	}
+
+	constexpr auto NoBlock = std::numeric_limits<std::uint32_t>::max();
+
+	// Value numbering, two instructions computing the same operation on the same values get the same number
+	using Key = std::tuple<OpCode, std::uint64_t, std::uint64_t, std::uint64_t>;
+	std::map<Key, std::uint32_t> values;
+	std::vector<std::uint32_t>   value_of(num_code);
+	std::vector<std::uint32_t>   first_block;  // NoBlock until the value is first used by a live instruction
+	std::vector<bool>            shared;
+
+	for (std::uint32_t i = 0; i < num_code; ++i) {
+		auto& ins = m_code[i];
+		Key   key{ ins.op, ins.a, ins.b, ins.c };
+		switch (NumRegisterOperands(ins.op)) {
+		case 0:
+			if (ins.op == OpCode::kConst) {
+				key = { ins.op, std::bit_cast<std::uint32_t>(m_constants[ins.a]), 0, 0 };
+			}
+			break;
+		case 1:
+			key = { ins.op, value_of[ins.a], ins.op == OpCode::kIPow || ins.op == OpCode::kIPowInv ? ins.b : 0, 0 };
+			break;
+		case 2:
+			key = { ins.op, value_of[ins.a], value_of[ins.b], 0 };
+			break;
+		case 3:
+			key = { ins.op, value_of[ins.a], value_of[ins.b], value_of[ins.c] };
+			break;
+		}
+
+		auto [it, inserted] = values.try_emplace(key, static_cast<std::uint32_t>(first_block.size()));
+		value_of[i] = it->second;
+		if (inserted) {
+			first_block.emplace_back(live[i] ? block_of[i] : NoBlock);
+			shared.emplace_back(false);
+		} else if (live[i]) {
+			if (first_block[it->second] == NoBlock) {
+				first_block[it->second] = block_of[i];
+			} else if (first_block[it->second] != block_of[i]) {
+				shared[it->second] = true;
+			}
+		}
+	}
+
+	// Re-emit, shared values first in the order they first appeared, which keeps operands ahead of their users
+	std::vector<Instruction>   code;
+	std::vector<std::uint32_t> value_register(first_block.size(), NoRegister);
+	code.reserve(num_code);
+
+	auto emit = [&](std::uint32_t a_index) {
+		auto ins = m_code[a_index];
+		switch (NumRegisterOperands(ins.op)) {
+		case 3:
+			ins.c = value_register[value_of[ins.c]];
+			[[fallthrough]];
+		case 2:
+			ins.b = value_register[value_of[ins.b]];
+			[[fallthrough]];
+		case 1:
+			ins.a = value_register[value_of[ins.a]];
+			break;
+		}
+		ins.dst = static_cast<std::uint32_t>(code.size());
+		value_register[value_of[a_index]] = ins.dst;
+		code.emplace_back(ins);
+	};
+
+	for (std::uint32_t i = 0; i < num_code; ++i) {
+		if (live[i] && shared[value_of[i]] && value_register[value_of[i]] == NoRegister) {
+			emit(i);
+		}
+	}
+	m_prologue_end = static_cast<std::uint32_t>(code.size());
+
+	for (auto& block : m_blocks) {
+		auto begin = static_cast<std::uint32_t>(code.size());
+		for (std::uint32_t i = block.begin; i < block.end; ++i) {
+			if (live[i] && value_register[value_of[i]] == NoRegister) {
+				emit(i);
+			}
+		}
+		block.begin = begin;
+		block.end = static_cast<std::uint32_t>(code.size());
+	}
+
+	for (auto& term : m_terms) {
+		term = value_register[value_of[term]];
+	}
+	for (auto& output : m_rule_outputs) {
+		output.reg = value_register[value_of[output.reg]];
+	}
+
+	m_num_eliminated = num_live - static_cast<std::uint32_t>(code.size());
+	m_code = std::move(code);
+}
+
+float daf::RuleProgram::IntegerPow(float v, std::uint32_t p)
+{
+	switch (p) {
+	case 0:
+		return 1.f;
+	case 1:
+		return v;
+	case 2:
+		return v * v;
+	case 3:
+		return v * v * v;
+	case 4:
+		{
+			float v_2 = v * v;
+			return v_2 * v_2;
+		}
+	case 5:
+		return IntegerPow(v, 4) * v;
+	case 6:
+		{
+			float v_3 = IntegerPow(v, 3);
+			return v_3 * v_3;
+		}
+	case 7:
+		return IntegerPow(v, 6) * v;
+	case 8:
+		{
+			float v_4 = IntegerPow(v, 4);
+			return v_4 * v_4;
+		}
+	case 9:
+		return IntegerPow(v, 8) * v;
+	case 10:
+		{
+			float v_5 = IntegerPow(v, 5);
+			return v_5 * v_5;
+		}
+	default:
+		{
+			float l = 1.f;
+			while (p) {
+				if (p % 2 == 1) {
+					l *= v;
+					--p;
+				}
+				v *= v;
+				p /= 2;
+			}
+			return l;
+		}
+	}
+}
+
+float daf::RuleProgram::Compute(const Instruction& a_ins, const float* r)
+{
+	switch (a_ins.op) {
+	case OpCode::kNeg:
+		return -r[a_ins.a];
+	case OpCode::kNot:
+		return IsTrue(r[a_ins.a]) ? 0.f : 1.f;
+	case OpCode::kAbs:
+		return r[a_ins.a] < 0.f ? -r[a_ins.a] : r[a_ins.a];
+	case OpCode::kSqrt:
+		return std::sqrt(r[a_ins.a]);
+	case OpCode::kFloor:
+		return std::floor(r[a_ins.a]);
+	case OpCode::kCeil:
+		return std::ceil(r[a_ins.a]);
+	case OpCode::kIPow:
+		return IntegerPow(r[a_ins.a], a_ins.b);
+	case OpCode::kIPowInv:
+		return 1.f / IntegerPow(r[a_ins.a], a_ins.b);
+	case OpCode::kAdd:
+		return r[a_ins.a] + r[a_ins.b];
+	case OpCode::kSub:
+		return r[a_ins.a] - r[a_ins.b];
+	case OpCode::kMul:
+		return r[a_ins.a] * r[a_ins.b];
+	case OpCode::kDiv:
+		return r[a_ins.a] / r[a_ins.b];
+	case OpCode::kMod:
+		return std::fmod(r[a_ins.a], r[a_ins.b]);
+	case OpCode::kPow:
+		return std::pow(r[a_ins.a], r[a_ins.b]);
+	case OpCode::kMin:
+		return std::min(r[a_ins.a], r[a_ins.b]);
+	case OpCode::kMax:
+		return std::max(r[a_ins.a], r[a_ins.b]);
+	case OpCode::kLt:
+		return r[a_ins.a] < r[a_ins.b] ? 1.f : 0.f;
+	case OpCode::kLte:
+		return r[a_ins.a] <= r[a_ins.b] ? 1.f : 0.f;
+	case OpCode::kGt:
+		return r[a_ins.a] > r[a_ins.b] ? 1.f : 0.f;
+	case OpCode::kGte:
+		return r[a_ins.a] >= r[a_ins.b] ? 1.f : 0.f;
+	case OpCode::kEq:
+		return r[a_ins.a] == r[a_ins.b] ? 1.f : 0.f;
+	case OpCode::kNe:
+		return r[a_ins.a] != r[a_ins.b] ? 1.f : 0.f;
+	case OpCode::kAnd:
+		return IsTrue(r[a_ins.a]) && IsTrue(r[a_ins.b]) ? 1.f : 0.f;
+	case OpCode::kOr:
+		return IsTrue(r[a_ins.a]) || IsTrue(r[a_ins.b]) ? 1.f : 0.f;
+	case OpCode::kClamp:
+		return r[a_ins.b] < r[a_ins.a] ? r[a_ins.a] : (r[a_ins.b] > r[a_ins.c] ? r[a_ins.c] : r[a_ins.b]);
+	case OpCode::kSelect:
+		return IsTrue(r[a_ins.a]) ? r[a_ins.b] : r[a_ins.c];
+	default:  // kConst, kLoad and kFallback don't read registers
+		return 0.f;
+	}
+}
+
+void daf::RuleProgram::Run(const float* a_slots, float* r, std::uint32_t a_begin, std::uint32_t a_end) const
+{
+	for (std::uint32_t i = a_begin; i < a_end; ++i) {
+		const auto& ins = m_code[i];
+		switch (ins.op) {
+		case OpCode::kConst:
+			r[ins.dst] = m_constants[ins.a];
+			break;
+		case OpCode::kLoad:
+			r[ins.dst] = a_slots[ins.a];
+			break;
+		case OpCode::kFallback:
+			r[ins.dst] = m_fallbacks[ins.a]->Evaluate();
+			break;
+		default:
+			r[ins.dst] = Compute(ins, r);
+			break;
+		}
+	}
+}
+
+void daf::RuleProgram::RunBatch(const float* a_slots, float* a_registers, std::size_t a_lanes, std::uint32_t a_begin, std::uint32_t a_end) const
+{
+	const std::size_t n = a_lanes;
+	auto              row = [a_registers, n](std::uint32_t reg) { return a_registers + reg * n; };
+
+	for (std::uint32_t i = a_begin; i < a_end; ++i) {
+		const auto& ins = m_code[i];
+		float*      d = row(ins.dst);
+		switch (ins.op) {
+		case OpCode::kConst:
+			std::fill_n(d, n, m_constants[ins.a]);
+			break;
+		case OpCode::kLoad:
+			std::copy_n(a_slots + ins.a * n, n, d);
+			break;
+		case OpCode::kFallback:  // Filled in before the kernel runs
+			break;
+		case OpCode::kNeg:
+			UnaryLanes(d, row(ins.a), n, [](float x) { return -x; });
+			break;
+		case OpCode::kNot:
+			UnaryLanes(d, row(ins.a), n, [](float x) { return IsTrue(x) ? 0.f : 1.f; });
+			break;
+		case OpCode::kAbs:
+			UnaryLanes(d, row(ins.a), n, [](float x) { return x < 0.f ? -x : x; });
+			break;
+		case OpCode::kSqrt:
+			UnaryLanes(d, row(ins.a), n, [](float x) { return std::sqrt(x); });
+			break;
+		case OpCode::kFloor:
+			UnaryLanes(d, row(ins.a), n, [](float x) { return std::floor(x); });
+			break;
+		case OpCode::kCeil:
+			UnaryLanes(d, row(ins.a), n, [](float x) { return std::ceil(x); });
+			break;
+		case OpCode::kIPow:
+			UnaryLanes(d, row(ins.a), n, [p = ins.b](float x) { return IntegerPow(x, p); });
+			break;
+		case OpCode::kIPowInv:
+			UnaryLanes(d, row(ins.a), n, [p = ins.b](float x) { return 1.f / IntegerPow(x, p); });
+			break;
+		case OpCode::kAdd:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return x + y; });
+			break;
+		case OpCode::kSub:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return x - y; });
+			break;
+		case OpCode::kMul:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return x * y; });
+			break;
+		case OpCode::kDiv:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return x / y; });
+			break;
+		case OpCode::kMod:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return std::fmod(x, y); });
+			break;
+		case OpCode::kPow:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return std::pow(x, y); });
+			break;
+		case OpCode::kMin:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return std::min(x, y); });
+			break;
+		case OpCode::kMax:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return std::max(x, y); });
+			break;
+		case OpCode::kLt:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return x < y ? 1.f : 0.f; });
+			break;
+		case OpCode::kLte:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return x <= y ? 1.f : 0.f; });
+			break;
+		case OpCode::kGt:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return x > y ? 1.f : 0.f; });
+			break;
+		case OpCode::kGte:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return x >= y ? 1.f : 0.f; });
+			break;
+		case OpCode::kEq:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return x == y ? 1.f : 0.f; });
+			break;
+		case OpCode::kNe:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return x != y ? 1.f : 0.f; });
+			break;
+		case OpCode::kAnd:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return IsTrue(x) && IsTrue(y) ? 1.f : 0.f; });
+			break;
+		case OpCode::kOr:
+			BinaryLanes(d, row(ins.a), row(ins.b), n, [](float x, float y) { return IsTrue(x) || IsTrue(y) ? 1.f : 0.f; });
+			break;
+		case OpCode::kClamp:
+			TernaryLanes(d, row(ins.a), row(ins.b), row(ins.c), n, [](float lo, float x, float hi) { return x < lo ? lo : (x > hi ? hi : x); });
+			break;
+		case OpCode::kSelect:
+			TernaryLanes(d, row(ins.a), row(ins.b), row(ins.c), n, [](float c, float x, float y) { return IsTrue(c) ? x : y; });
+			break;
+		}
+	}
+}
+
+void daf::RuleProgram::AccumulateBatch(const MorphBlock& a_block, const float* a_registers, std::size_t a_lanes, float* a_values) const
+{
+	if (a_block.is_static) {
+		std::fill_n(a_values, a_lanes, a_block.static_value);
+		return;
+	} else if (a_block.is_setter) {
+		std::copy_n(a_registers + m_terms[a_block.first_term] * a_lanes, a_lanes, a_values);
+		return;
+	}
+
+	std::fill_n(a_values, a_lanes, 0.f);
+	for (std::uint32_t i = 0; i < a_block.num_terms; ++i) {
+		const float* term = a_registers + m_terms[a_block.first_term + i] * a_lanes;
+		for (std::size_t l = 0; l < a_lanes; ++l) {
+			a_values[l] += term[l];
+		}
+	}
+}
@@ -0,0 +1,265 @@
+#pragma once
+#include "Evaluatable.h"
+
+namespace daf
+{
+	// A flat, register-based program lowered from every Rule of a MorphEvaluationRuleSet.
+	// Each expression node becomes one instruction writing its own register, so a whole ruleset
+	// evaluates in one linear pass over a dense symbol slot array instead of walking one exprtk AST per rule.
+	// Rules using exprtk features the lowering doesn't understand are kept as kFallback instructions.
+	class RuleProgram
+	{
+	public:
+		using Fallback = utils::Evaluatable<float>;
+
+		enum class OpCode : std::uint8_t
+		{
+			kConst,     // r[dst] = constants[a]
+			kLoad,      // r[dst] = slots[a]
+			kFallback,  // r[dst] = fallbacks[a]->Evaluate()
+			kNeg,
+			kNot,
+			kAbs,
+			kSqrt,
+			kFloor,
+			kCeil,
+			kIPow,     // r[dst] = r[a] ^ b, exprtk cardinal pow
+			kIPowInv,  // r[dst] = 1 / (r[a] ^ b)
+			kAdd,
+			kSub,
+			kMul,
+			kDiv,
+			kMod,
+			kPow,
+			kMin,
+			kMax,
+			kLt,
+			kLte,
+			kGt,
+			kGte,
+			kEq,
+			kNe,
+			kAnd,
+			kOr,
+			kClamp,   // r[dst] = clamp(r[a], r[b], r[c]), exprtk argument order (lo, x, hi)
+			kSelect   // r[dst] = r[a] ? r[b] : r[c]
+		};
+
+		struct Instruction
+		{
+			OpCode        op{ OpCode::kConst };
+			std::uint32_t dst{ 0 };
+			std::uint32_t a{ 0 };
+			std::uint32_t b{ 0 };
+			std::uint32_t c{ 0 };
+		};
+
+		// Instructions [begin, end) compute every term of one morph target.
+		// A static block only has constant terms, its value is folded at load time and it runs no code.
+		struct MorphBlock
+		{
+			std::string_view morph_name;
+			bool             is_setter{ false };
+			bool             is_static{ false };
+			float            static_value{ 0.f };
+			std::uint32_t    begin{ 0 };
+			std::uint32_t    end{ 0 };
+			std::uint32_t    first_term{ 0 };
+			std::uint32_t    num_terms{ 0 };
+		};
+
+		// Register holding the result of a single Rule, used to verify the program against exprtk.
+		// Constant rules keep their folded value instead, dead rules (never read by any morph) have no register.
+		struct RuleOutput
+		{
+			Fallback*     rule{ nullptr };
+			std::uint32_t reg{ 0 };
+			bool          lowered{ false };
+			bool          constant{ false };
+			float         value{ 0.f };
+		};
+
+		static constexpr std::uint32_t NoRegister = std::numeric_limits<std::uint32_t>::max();
+
+		class Builder
+		{
+		public:
+			// a_slots maps lower-case symbol names (exprtk symbols are case-insensitive) to slot indices
+			Builder(const std::unordered_map<std::string, std::uint32_t>& a_slots, std::uint32_t a_numSlots, const exprtk::symbol_table<float>& a_symbolTable);
+
+			void BeginMorph(std::string_view a_morphName);
+
+			// Returns false if the rule could not be lowered and was added as a fallback
+			bool AddRule(const std::string& a_expr, bool a_isSetter, Fallback* a_rule, bool a_forceFallback = false);
+
+			void EndMorph();
+
+			std::unique_ptr<RuleProgram> Finish();
+
+		private:
+			struct Token
+			{
+				enum class Type : std::uint8_t
+				{
+					kEnd,
+					kNumber,
+					kSymbol,
+					kOperator,
+					kError
+				};
+
+				Type        type{ Type::kEnd };
+				std::string text;
+			};
+
+			const std::unordered_map<std::string, std::uint32_t>& m_slots;
+			const exprtk::symbol_table<float>&                    m_symbol_table;
+			std::unique_ptr<RuleProgram>                           m_program;
+
+			bool m_in_morph{ false };
+
+			// Parser state of the rule currently being lowered
+			std::vector<Token> m_tokens;
+			std::size_t        m_cursor{ 0 };
+			bool               m_failed{ false };
+
+			bool Tokenize(const std::string& a_expr);
+
+			const Token& Peek() const { return m_tokens[m_cursor]; }
+
+			bool PeekOperator(std::string_view a_op) const
+			{
+				auto& token = Peek();
+				return token.type == Token::Type::kOperator && token.text == a_op;
+			}
+
+			bool Expect(std::string_view a_op);
+
+			std::uint32_t ParseExpression(int a_precedence);
+			std::uint32_t ParseBranch();
+			std::uint32_t ParseSymbol(const std::string& a_symbol);
+			std::uint32_t ParseFunction(const std::string& a_function);
+			std::uint32_t ParseTernary(std::uint32_t a_condition);
+
+			std::uint32_t Fail()
+			{
+				m_failed = true;
+				return 0;
+			}
+
+			std::uint32_t EmitConst(float a_value);
+			std::uint32_t Emit(OpCode a_op, std::uint32_t a_a = 0, std::uint32_t a_b = 0, std::uint32_t a_c = 0);
+			std::uint32_t EmitPow(std::uint32_t a_base, std::uint32_t a_exponent);
+
+			// Replaces instruction a_reg by a kConst if all its operands are constants
+			std::uint32_t Fold(std::uint32_t a_reg);
+
+			bool IsConst(std::uint32_t a_reg) const { return m_program->m_code[a_reg].op == OpCode::kConst; }
+
+			float ConstValue(std::uint32_t a_reg) const { return m_program->m_constants[m_program->m_code[a_reg].a]; }
+
+			// Turns morph blocks whose terms are all constant into static blocks
+			void FoldStaticBlocks();
+		};
+
+		std::uint32_t NumSlots() const { return m_num_slots; }
+
+		std::uint32_t NumRegisters() const { return static_cast<std::uint32_t>(m_code.size()); }
+
+		// Fallback rules that are still evaluated, dead ones are dropped with their block
+		std::size_t NumFallbacks() const { return m_fallback_code.size(); }
+
+		// Instructions removed by common subexpression elimination
+		std::uint32_t NumEliminated() const { return m_num_eliminated; }
+
+		// Lowered rules whose value is known at load time
+		std::uint32_t NumFoldedRules() const { return m_num_folded_rules; }
+
+		// Rules that can never affect a morph: constant zero Adders and rules overridden by a Setter
+		std::uint32_t NumDeadRules() const { return m_num_dead_rules; }
+
+		// Morph blocks resolved at load time, see MorphBlock::is_static
+		std::uint32_t NumStaticMorphs() const { return m_num_static_morphs; }
+
+		// Instructions [0, PrologueEnd()) compute the subexpressions shared by several morph blocks,
+		// they must run before any block is evaluated on its own
+		std::uint32_t PrologueEnd() const { return m_prologue_end; }
+
+		const std::vector<MorphBlock>& GetMorphBlocks() const { return m_blocks; }
+
+		const std::vector<RuleOutput>& GetRuleOutputs() const { return m_rule_outputs; }
+
+		// Sum of the term registers of a morph block, in rule order, the same way the exprtk path accumulates Adders
+		float Accumulate(const MorphBlock& a_block, const float* a_registers) const
+		{
+			if (a_block.is_static) {
+				return a_block.static_value;
+			} else if (a_block.is_setter) {
+				return a_registers[m_terms[a_block.first_term]];
+			}
+
+			float value = 0.f;
+			for (std::uint32_t i = 0; i < a_block.num_terms; ++i) {
+				value += a_registers[m_terms[a_block.first_term + i]];
+			}
+			return value;
+		}
+
+		// a_registers must hold at least NumRegisters() floats
+		void Run(const float* a_slots, float* a_registers) const
+		{
+			Run(a_slots, a_registers, 0, static_cast<std::uint32_t>(m_code.size()));
+		}
+
+		void Run(const float* a_slots, float* a_registers, std::uint32_t a_begin, std::uint32_t a_end) const;
+
+		// Structure-of-arrays evaluation of a_lanes actors at once: slot s of lane l is a_slots[s * a_lanes + l],
+		// register r of lane l is a_registers[r * a_lanes + l]. Every instruction becomes a plain loop over lanes
+		// that the compiler vectorizes. a_bindLane(lane) must expose that lane's symbols to exprtk for fallbacks.
+		template <class _BindLane_T>
+		void RunBatch(const float* a_slots, float* a_registers, std::size_t a_lanes, _BindLane_T&& a_bindLane) const
+		{
+			// Fallbacks only read symbols, so they are all evaluated up front, one lane at a time
+			if (!m_fallback_code.empty()) {
+				for (std::size_t lane = 0; lane < a_lanes; ++lane) {
+					a_bindLane(lane);
+					for (auto index : m_fallback_code) {
+						auto& ins = m_code[index];
+						a_registers[ins.dst * a_lanes + lane] = m_fallbacks[ins.a]->Evaluate();
+					}
+				}
+			}
+			RunBatch(a_slots, a_registers, a_lanes, 0, static_cast<std::uint32_t>(m_code.size()));
+		}
+
+		void RunBatch(const float* a_slots, float* a_registers, std::size_t a_lanes, std::uint32_t a_begin, std::uint32_t a_end) const;
+
+		// Per-lane Accumulate() of a RunBatch() register file into a_values[0, a_lanes)
+		void AccumulateBatch(const MorphBlock& a_block, const float* a_registers, std::size_t a_lanes, float* a_values) const;
+
+		// Same arithmetic as exprtk's ipow nodes (details::numeric::fast_exp), so results stay bit-identical
+		static float IntegerPow(float v, std::uint32_t p);
+
+	private:
+		// Arithmetic of the instructions that only read registers, shared by Run() and constant folding
+		static float Compute(const Instruction& a_ins, const float* r);
+
+		// Value-numbers every instruction, keeps one instance of each value per block and hoists values used by
+		// several blocks into the prologue. Instructions no term of a non-static block depends on are dropped.
+		void EliminateCommonSubexpressions();
+
+		std::uint32_t                     m_num_slots{ 0 };
+		std::vector<Instruction>          m_code;
+		std::vector<float>                m_constants;
+		std::vector<Fallback*>            m_fallbacks;
+		std::vector<std::uint32_t>        m_fallback_code;
+		std::vector<std::uint32_t>        m_terms;
+		std::vector<MorphBlock>           m_blocks;
+		std::vector<RuleOutput>           m_rule_outputs;
+		std::uint32_t                     m_prologue_end{ 0 };
+		std::uint32_t                     m_num_eliminated{ 0 };
+		std::uint32_t                     m_num_folded_rules{ 0 };
+		std::uint32_t                     m_num_dead_rules{ 0 };
+		std::uint32_t                     m_num_static_morphs{ 0 };
+	};
+}
@@ -0,0 +1,301 @@
+#include "RulesetCache.h"
+
+namespace
+{
+	struct CacheHeader
+	{
+		std::uint32_t magic{ daf::RulesetCacheMagic };
+		std::uint32_t version{ daf::RulesetCacheVersion };
+		std::uint32_t num_entries{ 0 };
+		std::uint32_t reserved{ 0 };
+		std::uint64_t payload_size{ 0 };
+		std::uint64_t checksum{ 0 };
+	};
+
+	// FNV-1a
+	std::uint64_t Checksum(std::span<const std::byte> a_data)
+	{
+		std::uint64_t hash = 14695981039346656037ull;
+		for (auto b : a_data) {
+			hash ^= static_cast<std::uint64_t>(b);
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	class Writer
+	{
+	public:
+		std::vector<std::byte> buffer;
+
+		template <class _T>
+			requires std::is_trivially_copyable_v<_T>
+		void Write(const _T& a_value)
+		{
+			auto bytes = reinterpret_cast<const std::byte*>(&a_value);
+			buffer.insert(buffer.end(), bytes, bytes + sizeof(_T));
+		}
+
+		void WriteString(std::string_view a_str)
+		{
+			Write(static_cast<std::uint32_t>(a_str.size()));
+			auto bytes = reinterpret_cast<const std::byte*>(a_str.data());
+			buffer.insert(buffer.end(), bytes, bytes + a_str.size());
+		}
+	};
+
+	// Bounds-checked reads, any overrun marks the whole cache as corrupt
+	class Reader
+	{
+	public:
+		Reader(std::span<const std::byte> a_data) :
+			m_data(a_data) {}
+
+		template <class _T>
+			requires std::is_trivially_copyable_v<_T>
+		bool Read(_T& a_value)
+		{
+			if (m_data.size() - m_offset < sizeof(_T)) {
+				return false;
+			}
+			std::memcpy(&a_value, m_data.data() + m_offset, sizeof(_T));
+			m_offset += sizeof(_T);
+			return true;
+		}
+
+		bool ReadString(std::string& a_str)
+		{
+			std::uint32_t size = 0;
+			if (!Read(size) || m_data.size() - m_offset < size) {
+				return false;
+			}
+			a_str.assign(reinterpret_cast<const char*>(m_data.data() + m_offset), size);
+			m_offset += size;
+			return true;
+		}
+
+		bool AtEnd() const { return m_offset == m_data.size(); }
+
+	private:
+		std::span<const std::byte> m_data;
+		std::size_t                m_offset{ 0 };
+	};
+
+	void WriteRules(Writer& a_writer, const std::vector<daf::MorphEvaluationRuleSet::ParsedScript::RuleEntry>& a_rules)
+	{
+		a_writer.Write(static_cast<std::uint32_t>(a_rules.size()));
+		for (auto& rule : a_rules) {
+			a_writer.WriteString(rule.morph_name);
+			a_writer.WriteString(rule.expression);
+		}
+	}
+
+	bool ReadRules(Reader& a_reader, std::vector<daf::MorphEvaluationRuleSet::ParsedScript::RuleEntry>& a_rules)
+	{
+		std::uint32_t count = 0;
+		if (!a_reader.Read(count)) {
+			return false;
+		}
+		a_rules.resize(count);
+		for (auto& rule : a_rules) {
+			if (!a_reader.ReadString(rule.morph_name) || !a_reader.ReadString(rule.expression)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::int64_t GetWriteTime(const std::filesystem::path& a_file, std::error_code& a_ec)
+	{
+		return std::filesystem::last_write_time(a_file, a_ec).time_since_epoch().count();
+	}
+}
+
+bool daf::RulesetCache::Load(const std::filesystem::path& a_cacheFile)
+{
+	std::lock_guard lock(m_mutex);
+	m_entries.clear();
+	m_dirty = false;
+
+	HANDLE file = CreateFileW(a_cacheFile.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	bool          loaded = false;
+	LARGE_INTEGER file_size{};
+	if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+		if (HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr); mapping) {
+			if (auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0); view) {
+				loaded = Deserialize({ static_cast<const std::byte*>(view), static_cast<std::size_t>(file_size.QuadPart) });
+				UnmapViewOfFile(view);
+			}
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+
+	if (!loaded) {
+		logger::warn("Ruleset cache '{}' is outdated or corrupt, ignoring it.", a_cacheFile.string());
+		m_entries.clear();
+		return false;
+	}
+
+	logger::info("Loaded ruleset cache '{}' with {} files.", a_cacheFile.string(), m_entries.size());
+	return true;
+}
+
+bool daf::RulesetCache::Save(const std::filesystem::path& a_cacheFile)
+{
+	std::lock_guard lock(m_mutex);
+
+	std::erase_if(m_entries, [](const auto& a_entry) { return !a_entry.second.used; });
+	for (auto& [path, entry] : m_entries) {
+		entry.used = false;
+	}
+
+	if (!m_dirty) {
+		return true;
+	}
+
+	auto data = Serialize();
+
+	// Write next to the cache and swap it in, so a crash never leaves a half-written cache behind
+	auto tmp_file = a_cacheFile;
+	tmp_file += ".tmp";
+	{
+		std::ofstream file(tmp_file, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			logger::error("Failed to write ruleset cache: {}", tmp_file.string());
+			return false;
+		}
+		file.write(reinterpret_cast<const char*>(data.data()), data.size());
+		if (!file) {
+			logger::error("Failed to write ruleset cache: {}", tmp_file.string());
+			return false;
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmp_file, a_cacheFile, ec);
+	if (ec) {
+		logger::error("Failed to replace ruleset cache '{}': {}", a_cacheFile.string(), ec.message());
+		return false;
+	}
+
+	m_dirty = false;
+	return true;
+}
+
+const daf::RulesetCache::ParsedScript* daf::RulesetCache::Get(const std::filesystem::path& a_file)
+{
+	std::error_code ec;
+	auto            size = std::filesystem::file_size(a_file, ec);
+	auto            write_time = ec ? 0 : GetWriteTime(a_file, ec);
+	if (ec) {
+		logger::error("Failed to open file: {}", a_file.string());
+		return nullptr;
+	}
+
+	auto key = a_file.string();
+	{
+		std::lock_guard lock(m_mutex);
+		if (auto it = m_entries.find(key); it != m_entries.end() && it->second.size == size && it->second.write_time == write_time) {
+			it->second.used = true;
+			++m_hits;
+			return &it->second.script;
+		}
+	}
+
+	// Parse outside the lock, files of different rulesets can be read concurrently
+	Entry entry{ size, write_time, true };
+	if (!MorphEvaluationRuleSet::ReadScript(key, entry.script)) {
+		return nullptr;
+	}
+	++m_misses;
+
+	std::lock_guard lock(m_mutex);
+	m_dirty = true;
+
+	// Another ruleset may have read the same file meanwhile, keep its entry alive
+	auto [it, inserted] = m_entries.try_emplace(key, std::move(entry));
+	if (!inserted && (it->second.size != size || it->second.write_time != write_time)) {
+		it->second = std::move(entry);
+	}
+	it->second.used = true;
+	return &it->second.script;
+}
+
+bool daf::RulesetCache::Deserialize(std::span<const std::byte> a_data)
+{
+	CacheHeader header;
+	if (a_data.size() < sizeof(CacheHeader)) {
+		return false;
+	}
+	std::memcpy(&header, a_data.data(), sizeof(CacheHeader));
+
+	auto payload = a_data.subspan(sizeof(CacheHeader));
+	if (header.magic != RulesetCacheMagic || header.version != RulesetCacheVersion ||
+		header.payload_size != payload.size() || header.checksum != Checksum(payload)) {
+		return false;
+	}
+
+	Reader reader(payload);
+	for (std::uint32_t i = 0; i < header.num_entries; ++i) {
+		std::string path;
+		Entry       entry;
+		if (!reader.ReadString(path) || !reader.Read(entry.size) || !reader.Read(entry.write_time)) {
+			return false;
+		}
+
+		std::uint32_t num_aliases = 0;
+		if (!reader.Read(num_aliases)) {
+			return false;
+		}
+		entry.script.aliases.resize(num_aliases);
+		for (auto& alias : entry.script.aliases) {
+			if (!reader.ReadString(alias.symbol) || !reader.ReadString(alias.editorID) || !reader.Read(alias.type) || !reader.Read(alias.default_to)) {
+				return false;
+			}
+		}
+
+		if (!ReadRules(reader, entry.script.adders) || !ReadRules(reader, entry.script.setters)) {
+			return false;
+		}
+
+		m_entries[std::move(path)] = std::move(entry);
+	}
+
+	return reader.AtEnd();
+}
+
+std::vector<std::byte> daf::RulesetCache::Serialize() const
+{
+	Writer payload;
+	for (auto& [path, entry] : m_entries) {
+		payload.WriteString(path);
+		payload.Write(entry.size);
+		payload.Write(entry.write_time);
+
+		payload.Write(static_cast<std::uint32_t>(entry.script.aliases.size()));
+		for (auto& alias : entry.script.aliases) {
+			payload.WriteString(alias.symbol);
+			payload.WriteString(alias.editorID);
+			payload.Write(alias.type);
+			payload.Write(alias.default_to);
+		}
+
+		WriteRules(payload, entry.script.adders);
+		WriteRules(payload, entry.script.setters);
+	}
+
+	CacheHeader header;
+	header.num_entries = static_cast<std::uint32_t>(m_entries.size());
+	header.payload_size = payload.buffer.size();
+	header.checksum = Checksum(payload.buffer);
+
+	Writer writer;
+	writer.Write(header);
+	writer.buffer.insert(writer.buffer.end(), payload.buffer.begin(), payload.buffer.end());
+	return writer.buffer;
+}
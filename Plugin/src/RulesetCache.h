@@ -0,0 +1,60 @@
+#pragma once
+#include "LogWrapper.h"
+#include "MorphEvaluationRuleSet.h"
+#include "SingletonBase.h"
+
+namespace daf
+{
+	// Keep parsed ruleset files in a binary cache next to the Rulesets folder, so unchanged files skip JSON parsing
+	inline constexpr bool          CacheParsedRulesets = true;
+	inline constexpr std::uint32_t RulesetCacheMagic = 0x43464144;  // "DAFC"
+	inline constexpr std::uint32_t RulesetCacheVersion = 1;  // Bump whenever the layout of ParsedScript or the cache changes
+
+	// Parsed ruleset files keyed by path, file size and last write time.
+	// Layout: header { magic, version, entry count, payload size, payload checksum }, then the entries.
+	class RulesetCache :
+		public utils::SingletonBase<RulesetCache>
+	{
+		friend class utils::SingletonBase<RulesetCache>;
+
+	public:
+		using ParsedScript = MorphEvaluationRuleSet::ParsedScript;
+
+		// Memory-maps and validates a_cacheFile, a missing, outdated or corrupt cache just starts empty
+		bool Load(const std::filesystem::path& a_cacheFile);
+
+		// Writes the entries used since the last Load() or Save(), dropping files that no longer exist.
+		// Does nothing if no file was reparsed.
+		bool Save(const std::filesystem::path& a_cacheFile);
+
+		// Returns the parsed contents of a_file, reading the JSON only if the file changed since it was cached.
+		// Returns nullptr if the file can't be read.
+		const ParsedScript* Get(const std::filesystem::path& a_file);
+
+		std::size_t GetHits() const { return m_hits; }
+
+		std::size_t GetMisses() const { return m_misses; }
+
+	private:
+		RulesetCache() = default;
+
+		struct Entry
+		{
+			std::uint64_t size{ 0 };
+			std::int64_t  write_time{ 0 };
+			bool          used{ false };
+			ParsedScript  script;
+		};
+
+		std::mutex                             m_mutex;
+		std::unordered_map<std::string, Entry> m_entries;
+		bool                                   m_dirty{ false };
+
+		std::atomic<std::size_t> m_hits{ 0 };
+		std::atomic<std::size_t> m_misses{ 0 };
+
+		bool Deserialize(std::span<const std::byte> a_data);
+
+		std::vector<std::byte> Serialize() const;
+	};
+}
@@ -3,6 +3,7 @@
 #include "RE/E/Events.h"
 
 #include "EventDispatcher.h"
+#include "FlatActorTable.h"
 #include "HookManager.h"
 
 namespace events
@@ -451,8 +452,7 @@ namespace events
 			}
 
 			auto actor = a_vfunc_event.GetArg<0>();
-			if (!_get(actor)) {
-				_insert_or_allocate(actor, true);
+			if (!_get(actor) && !_insert_or_allocate(actor, true)) {  // Only the thread flipping the flag sends the first update
 				this->EventDispatcher<ActorFirstUpdateEvent>::Dispatch({ actor, a_vfunc_event.GetArg<1>() });
 			}
 			this->EventDispatcher<ActorUpdateEvent>::Dispatch({ actor, a_vfunc_event.GetArg<1>() });
@@ -463,14 +463,14 @@ namespace events
 			switch (a_event.saveLoadType) {
 			case SaveLoadEvent::SaveLoadType::kSaveLoad:
 				m_blocked = true;
-				m_actor_updated.clear();
+				_clear();
 				break;
 			case SaveLoadEvent::SaveLoadType::kSaveLoad_ListenersFinished:
 				m_blocked = false;
 				break;
 			case SaveLoadEvent::SaveLoadType::kPostSaveLoad:
 				m_blocked = true;
-				m_actor_updated.clear();
+				_clear();
 				break;
 			case SaveLoadEvent::SaveLoadType::kPostSaveLoad_ListenersFinished:
 				m_blocked = false;
@@ -487,7 +487,7 @@ namespace events
 
 		size_t NumWatching()
 		{
-			return m_actor_updated.size();
+			return m_actor_updated.Size() + m_num_overflow.load(std::memory_order_relaxed);
 		}
 
 	protected:
@@ -495,46 +495,103 @@ namespace events
 
 		ActorUpdatedEventDispatcher() { this->Register(); }
 
+		// Probed on every actor update, see utils::FlatActorTable
+		struct UpdateState
+		{
+			std::atomic<bool> updated{ false };
+
+			void Reset()
+			{
+				updated.store(false, std::memory_order_relaxed);
+			}
+		};
+
 		void WatchInstance(RE::Actor* a_actor)
 		{
-			m_actor_updated.insert({ a_actor, false });
+			if (auto state = m_actor_updated.Insert(a_actor->formID); state) {
+				state->updated.store(false, std::memory_order_relaxed);
+			} else {
+				_overflow_insert_or_allocate(a_actor, false);
+			}
 		}
 
 		void UnwatchInstance(RE::Actor* a_actor)
 		{
-			m_actor_updated.erase(a_actor);
+			if (!m_actor_updated.Erase(a_actor->formID) && m_num_overflow.load(std::memory_order_relaxed) > 0) {
+				std::lock_guard lock(m_overflow_lock);
+				m_overflow.erase(a_actor->formID);
+				m_num_overflow.store(m_overflow.size(), std::memory_order_relaxed);
+			}
 		}
 
 		bool _find(RE::Actor* a_actor) // Don't do anything if the element doesn't exist
 		{
-			tbb::concurrent_hash_map<RE::Actor*, bool>::const_accessor acc;
-			return m_actor_updated.find(acc, a_actor);
+			if (m_actor_updated.Find(a_actor->formID)) {
+				return true;
+			} else if (m_num_overflow.load(std::memory_order_relaxed) == 0) {
+				return false;
+			}
+			std::lock_guard lock(m_overflow_lock);
+			return m_overflow.contains(a_actor->formID);
 		}
 
 		bool _get(RE::Actor* a_actor) 
 		{
-			tbb::concurrent_hash_map<RE::Actor*, bool>::const_accessor acc;
-			if (m_actor_updated.find(acc, a_actor)) {
-				return acc->second;
+			if (auto state = m_actor_updated.Find(a_actor->formID); state) {
+				return state->updated.load(std::memory_order_relaxed);
+			} else if (m_num_overflow.load(std::memory_order_relaxed) == 0) {
+				return false;
 			}
-			return false;
+			std::lock_guard lock(m_overflow_lock);
+			auto            it = m_overflow.find(a_actor->formID);
+			return it != m_overflow.end() && it->second;
 		}
 
 		void _try_update(RE::Actor* a_actor, bool a_updated) // Don't do anything if the element doesn't exist
 		{
-			tbb::concurrent_hash_map<RE::Actor*, bool>::accessor acc;
-			if (m_actor_updated.find(acc, a_actor)) {
-				acc->second = a_updated;
+			if (auto state = m_actor_updated.Find(a_actor->formID); state) {
+				state->updated.store(a_updated, std::memory_order_relaxed);
+			} else if (m_num_overflow.load(std::memory_order_relaxed) > 0) {
+				std::lock_guard lock(m_overflow_lock);
+				if (auto it = m_overflow.find(a_actor->formID); it != m_overflow.end()) {
+					it->second = a_updated;
+				}
+			}
+		}
+
+		// Insert if not exist, otherwise update. Returns the previous value, false if it was just inserted
+		bool _insert_or_allocate(RE::Actor* a_actor, bool a_updated)
+		{
+			if (auto state = m_actor_updated.Insert(a_actor->formID); state) {
+				return state->updated.exchange(a_updated, std::memory_order_acq_rel);
 			}
+			return _overflow_insert_or_allocate(a_actor, a_updated);
 		}
 
-		void _insert_or_allocate(RE::Actor* a_actor, bool a_updated) // Insert if not exist, otherwise update
+		// Fallback once m_actor_updated is full or its free records are still cooling down, slower but every actor still gets its first update
+		bool _overflow_insert_or_allocate(RE::Actor* a_actor, bool a_updated)
 		{
-			tbb::concurrent_hash_map<RE::Actor*, bool>::accessor acc;
-			m_actor_updated.insert(acc, a_actor);
-			acc->second = a_updated;
+			std::lock_guard lock(m_overflow_lock);
+			auto [it, inserted] = m_overflow.try_emplace(a_actor->formID, false);
+			if (inserted) {
+				logger::c_warn("ActorUpdatedEventDispatcher: actor table has no free record ({} actors), tracking actor {:X} in a slower fallback map", m_actor_updated.Size(), a_actor->formID);
+				m_num_overflow.store(m_overflow.size(), std::memory_order_relaxed);
+			}
+			return std::exchange(it->second, a_updated);
 		}
 
-		tbb::concurrent_hash_map<RE::Actor*, bool> m_actor_updated;
+		void _clear()
+		{
+			m_actor_updated.Clear();
+			std::lock_guard lock(m_overflow_lock);
+			m_overflow.clear();
+			m_num_overflow.store(0, std::memory_order_relaxed);
+		}
+
+		utils::FlatActorTable<UpdateState, 4096> m_actor_updated;
+
+		mutex::NonReentrantSpinLock             m_overflow_lock;
+		std::unordered_map<RE::TESFormID, bool> m_overflow;
+		std::atomic<std::size_t>                m_num_overflow{ 0 };
 	};
 }
\ No newline at end of file
@@ -188,8 +188,40 @@ namespace utils
 		return ARMOHasAnyKeywords(a_armo, a_instanceData, spacesuit_kw_list);
 	}
 
+	inline bool IsSpacesuitKeyword(const RE::BGSKeyword* a_keyword)
+	{
+		static auto ArmorTypeSpacesuitBackpack_kw = RE::TESForm::LookupByID<RE::BGSKeyword>(0x0023C7BF);
+		static auto ArmorTypeSpacesuitBody_kw = RE::TESForm::LookupByID<RE::BGSKeyword>(0x0023C7C0);
+		static auto ArmorTypeSpacesuitHelmet_kw = RE::TESForm::LookupByID<RE::BGSKeyword>(0x0023C7C1);
+		return a_keyword && (a_keyword == ArmorTypeSpacesuitBackpack_kw || a_keyword == ArmorTypeSpacesuitBody_kw || a_keyword == ArmorTypeSpacesuitHelmet_kw);
+	}
+
 	std::uint32_t GetARMOModelOccupiedSlots(RE::TESObjectARMO* a_armo);
 
+	inline float GetDistanceSquared(const RE::TESObjectREFR* a_lhs, const RE::TESObjectREFR* a_rhs)
+	{
+		auto& a = a_lhs->data.location;
+		auto& b = a_rhs->data.location;
+		float dx = a.x - b.x;
+		float dy = a.y - b.y;
+		float dz = a.z - b.z;
+		return dx * dx + dy * dy + dz * dz;
+	}
+
+	// False if the actor's model is unloaded, e.g. culled for being too far away
+	inline bool IsActor3DLoaded(RE::Actor* a_actor)
+	{
+		auto loadedData = a_actor->loadedData.lock_read();
+		return loadedData->data3D.get() != nullptr;
+	}
+
+	// Looks an actor kept by form id up again, nullptr if it was deleted or its 3D is unloaded
+	inline RE::Actor* GetLoadedActor(RE::TESFormID a_formID)
+	{
+		auto actor = RE::TESForm::LookupByID<RE::Actor>(a_formID);
+		return actor && IsActor3DLoaded(actor) ? actor : nullptr;
+	}
+
 	RE::BGSFadeNode* GetModel(const char* a_modelName);
 
 	RE::BGSFadeNode* GetActorBaseSkeleton(RE::Actor* a_actor);